@@ -1,5 +1,5 @@
 Name:		libac
-Version:	2.0.0
+Version:	3.0.0
 Release:	1%{?dist}
 Summary:	Library of miscellaneous utility functions
 
@@ -28,7 +28,7 @@ rm -rf $RPM_BUILD_ROOT
 install -Dp -m644 src/include/libac.h $RPM_BUILD_ROOT/%{_includedir}/libac.h
 install -Dp -m0755 src/libac.so.%{version} $RPM_BUILD_ROOT/%{_libdir}/libac.so.%{version}
 cd $RPM_BUILD_ROOT/%{_libdir}
-ln -s libac.so.2 libac.so
+ln -s libac.so.3 libac.so
 cd -
 
 %post -p /sbin/ldconfig
@@ -46,6 +46,11 @@ rm -rf $RPM_BUILD_ROOT
 
 %changelog
 
+* Fri Oct 16 2026 Andrew Clayton <ac@sigsegv.uk> - 3.0.0-1
+- Bump major version for ABI break due to changes in the ac_htable_t,
+  ac_btree_t and ac_circ_buf_t structures.
+- New hash table and B+tree backends, lock-free circular buffers.
+
 * Fri Oct 31 2025 Andrew Clayton <ac@sigsegv.uk> - 2.0.0-1
 - Bump major version for API break due to changes in ac_circ_buf.
 - Lots of fixes all over.
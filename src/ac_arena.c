@@ -0,0 +1,173 @@
+/* SPDX-License-Identifier: LGPL-2.1 */
+
+/*
+ * ac_arena.c - Arena (bump) allocator
+ *
+ * Memory is handed out from large chunks by bumping an offset, there is no
+ * per allocation free. Everything is released in one go by resetting the
+ * arena, which keeps the chunks around for reuse, or destroying it.
+ *
+ * Copyright (c) 2026	Andrew Clayton <ac@sigsegv.uk>
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "include/libac.h"
+
+#define ARENA_DEF_CHUNK_SZ	(64 * 1024)
+
+struct ac_arena_chunk {
+	struct ac_arena_chunk *next;
+	size_t size;
+
+	max_align_t data[];
+};
+
+static struct ac_arena_chunk *arena_chunk_new(size_t size)
+{
+	struct ac_arena_chunk *chunk;
+
+	chunk = malloc(sizeof(struct ac_arena_chunk) + size);
+	chunk->next = NULL;
+	chunk->size = size;
+
+	return chunk;
+}
+
+/* Try to allocate from the current chunk, NULL if it doesn't fit */
+static void *arena_chunk_alloc(ac_arena_t *arena, size_t alignment,
+			       size_t size)
+{
+	const struct ac_arena_chunk *chunk = arena->cur;
+	uintptr_t start = (uintptr_t)chunk->data;
+	uintptr_t addr;
+
+	addr = (start + arena->off + alignment - 1) & ~(alignment - 1);
+	if (addr + size > start + chunk->size)
+		return NULL;
+
+	arena->off = addr + size - start;
+
+	return (void *)addr;
+}
+
+/**
+ * ac_arena_new - create a new arena
+ *
+ * @chunk_sz: The size of the chunks memory is allocated from, 0 for the
+ *            default (64KiB). Larger allocations get a chunk of their own
+ *
+ * Returns:
+ *
+ * A pointer to the new arena. Should be free'd with ac_arena_destroy()
+ */
+ac_arena_t *ac_arena_new(size_t chunk_sz)
+{
+	ac_arena_t *arena = malloc(sizeof(ac_arena_t));
+
+	arena->chunk_sz = chunk_sz ? chunk_sz : ARENA_DEF_CHUNK_SZ;
+	arena->chunks = arena_chunk_new(arena->chunk_sz);
+	arena->cur = arena->chunks;
+	arena->off = 0;
+
+	return arena;
+}
+
+/**
+ * ac_arena_aligned_alloc - allocate aligned memory from an arena
+ *
+ * @arena: The arena to allocate from
+ * @alignment: The alignment of the memory, must be a power of 2
+ * @size: The amount of memory to allocate
+ *
+ * Returns:
+ *
+ * A pointer to the allocated memory, this is only free'd by
+ * ac_arena_reset() or ac_arena_destroy(). NULL on error with errno set
+ * to ENOMEM if @size is too large
+ */
+void *ac_arena_aligned_alloc(ac_arena_t *arena, size_t alignment,
+			     size_t size)
+{
+	struct ac_arena_chunk *chunk;
+	size_t need;
+	void *ptr;
+
+	if (size > SIZE_MAX - sizeof(struct ac_arena_chunk) - alignment) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	need = size + alignment;
+
+	while ((ptr = arena_chunk_alloc(arena, alignment, size)) == NULL) {
+		chunk = arena->cur->next;
+		/* Chunks kept from before a reset may be too small */
+		if (!chunk || chunk->size < need) {
+			chunk = arena_chunk_new(need > arena->chunk_sz ?
+						need : arena->chunk_sz);
+			chunk->next = arena->cur->next;
+			arena->cur->next = chunk;
+		}
+		arena->cur = chunk;
+		arena->off = 0;
+	}
+
+	return ptr;
+}
+
+/**
+ * ac_arena_alloc - allocate memory from an arena
+ *
+ * @arena: The arena to allocate from
+ * @size: The amount of memory to allocate
+ *
+ * The memory is suitably aligned for any type, as with malloc(3).
+ *
+ * Returns:
+ *
+ * A pointer to the allocated memory, this is only free'd by
+ * ac_arena_reset() or ac_arena_destroy()
+ */
+void *ac_arena_alloc(ac_arena_t *arena, size_t size)
+{
+	return ac_arena_aligned_alloc(arena, _Alignof(max_align_t), size);
+}
+
+/**
+ * ac_arena_reset - free everything allocated from an arena
+ *
+ * @arena: The arena to reset
+ *
+ * The arena's chunks are kept to be reused by later allocations.
+ */
+void ac_arena_reset(ac_arena_t *arena)
+{
+	arena->cur = arena->chunks;
+	arena->off = 0;
+}
+
+/**
+ * ac_arena_destroy - destroy an arena and everything allocated from it
+ *
+ * @arena: The arena to destroy
+ */
+void ac_arena_destroy(ac_arena_t *arena)
+{
+	struct ac_arena_chunk *chunk;
+
+	if (!arena)
+		return;
+
+	chunk = arena->chunks;
+	while (chunk) {
+		struct ac_arena_chunk *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+
+	free(arena);
+}
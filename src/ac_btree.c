@@ -3,6 +3,15 @@
 /*
  * ac_btree.c - Binary search tree functions
  *
+ * A tree is either a thin wrapper around tsearch(3) (a binary tree with
+ * a node allocated per element) or a B+tree.
+ *
+ * The B+tree keeps the element pointers in cache line aligned nodes. The
+ * elements are all in the leaves, which are linked together in order, the
+ * inner nodes hold separator keys (which point to the first element of the
+ * subtree to their right), child pointers and the number of elements under
+ * each child, the latter giving O(log n) rank & select.
+ *
  * Copyright (c) 2017, 2019 - 2021	Andrew Clayton
  *					<andrew@digital-domain.net>
  */
@@ -10,15 +19,735 @@
 #define _GNU_SOURCE		/* tdestroy(3) */
 
 #include <stdlib.h>
+#include <string.h>
 #include <search.h>
+#include <errno.h>
 
 #include "include/libac.h"
 #include "platform.h"
 
+#define BTREE_CACHELINE_SZ	64
+#define BTREE_LEAF_SZ		256
+#define BTREE_INNER_SZ		384
+
+/*
+ * These fill BTREE_LEAF_SZ & BTREE_INNER_SZ, see struct btree_leaf &
+ * struct btree_inner below.
+ */
+#define BTREE_LEAF_MAX		29
+#define BTREE_LEAF_MIN		(BTREE_LEAF_MAX / 2)
+#define BTREE_INNER_MAX		16
+#define BTREE_INNER_MIN		(BTREE_INNER_MAX / 2)
+
+/*
+ * ->nr is the number of elements in a leaf or the number of children of
+ * an inner node.
+ */
+struct btree_node {
+	u16 nr;
+	bool leaf;
+};
+
+struct btree_leaf {
+	struct btree_node node;
+
+	struct btree_leaf *prev;
+	struct btree_leaf *next;
+
+	void *elems[BTREE_LEAF_MAX];
+};
+
+/*
+ * ->keys[i] is the first element under ->children[i + 1], ->counts[i] is
+ * the number of elements under ->children[i].
+ */
+struct btree_inner {
+	struct btree_node node;
+
+	void *keys[BTREE_INNER_MAX - 1];
+	struct btree_node *children[BTREE_INNER_MAX];
+	unsigned long counts[BTREE_INNER_MAX];
+};
+
+#define BTREE_LEAF(n)	((struct btree_leaf *)(n))
+#define BTREE_INNER(n)	((struct btree_inner *)(n))
+
+/*
+ * tsearch(3) & co don't say whether they found a match (or what it was),
+ * so the comparison function is wrapped to find out.
+ */
+static __thread struct {
+	int (*compar)(const void *, const void *);
+	bool matched;
+	const void *node;
+} btree_match;
+
+static int btree_compar_match(const void *a, const void *b)
+{
+	int ret = btree_match.compar(a, b);
+
+	if (ret == 0) {
+		btree_match.matched = true;
+		btree_match.node = b;
+	}
+
+	return ret;
+}
+
 static void null_free_node(void *data __always_unused)
 {
 }
 
+/* Nodes come from the trees arena, if it has one */
+static void *btree_node_alloc(const ac_btree_t *tree, bool leaf)
+{
+	size_t size = leaf ? BTREE_LEAF_SZ : BTREE_INNER_SZ;
+	struct btree_node *node;
+
+	if (tree->arena)
+		node = ac_arena_aligned_alloc(tree->arena, BTREE_CACHELINE_SZ,
+					      size);
+	else
+		node = aligned_alloc(BTREE_CACHELINE_SZ, size);
+
+	node->nr = 0;
+	node->leaf = leaf;
+
+	return node;
+}
+
+/* Arena nodes are only given back when the arena is reset/destroyed */
+static void btree_node_free(const ac_btree_t *tree, void *node)
+{
+	if (tree->arena)
+		return;
+
+	free(node);
+}
+
+static inline u16 btree_node_min(const struct btree_node *node)
+{
+	return node->leaf ? BTREE_LEAF_MIN : BTREE_INNER_MIN;
+}
+
+/* The number of elements under node */
+static unsigned long btree_node_count(const struct btree_node *node)
+{
+	unsigned long count = 0;
+	u16 i;
+
+	if (node->leaf)
+		return node->nr;
+
+	for (i = 0; i < node->nr; i++)
+		count += BTREE_INNER(node)->counts[i];
+
+	return count;
+}
+
+/* The index of the child of inner that key belongs under */
+static u16 btree_inner_idx(const ac_btree_t *tree,
+			   const struct btree_inner *inner, const void *key)
+{
+	u16 lo = 0;
+	u16 hi = inner->node.nr - 1;
+
+	while (lo < hi) {
+		u16 mid = (lo + hi) / 2;
+
+		if (tree->compar(key, inner->keys[mid]) < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
+}
+
+/*
+ * The index of the element in leaf matching key, or where it would be
+ * inserted if there isn't one.
+ */
+static u16 btree_leaf_idx(const ac_btree_t *tree,
+			  const struct btree_leaf *leaf, const void *key,
+			  bool *found)
+{
+	u16 lo = 0;
+	u16 hi = leaf->node.nr;
+
+	*found = false;
+	while (lo < hi) {
+		u16 mid = (lo + hi) / 2;
+		int cmp = tree->compar(key, leaf->elems[mid]);
+
+		if (cmp == 0) {
+			*found = true;
+			return mid;
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
+}
+
+static struct btree_leaf *btree_find_leaf(const ac_btree_t *tree,
+					  const void *key)
+{
+	const struct btree_node *node = tree->rootp;
+
+	while (!node->leaf) {
+		const struct btree_inner *inner = BTREE_INNER(node);
+
+		node = inner->children[btree_inner_idx(tree, inner, key)];
+	}
+
+	return BTREE_LEAF(node);
+}
+
+static struct btree_leaf *btree_first_leaf(const struct btree_node *node)
+{
+	while (!node->leaf)
+		node = BTREE_INNER(node)->children[0];
+
+	return BTREE_LEAF(node);
+}
+
+static struct btree_leaf *btree_last_leaf(const struct btree_node *node)
+{
+	while (!node->leaf)
+		node = BTREE_INNER(node)->children[node->nr - 1];
+
+	return BTREE_LEAF(node);
+}
+
+static int btree_height(const struct btree_node *node)
+{
+	int height = 0;
+
+	while (!node->leaf) {
+		node = BTREE_INNER(node)->children[0];
+		height++;
+	}
+
+	return height;
+}
+
+static void *btree_lookup(const ac_btree_t *tree, const void *key)
+{
+	const struct btree_leaf *leaf;
+	bool found;
+	u16 idx;
+
+	if (!tree->rootp)
+		return NULL;
+
+	leaf = btree_find_leaf(tree, key);
+	idx = btree_leaf_idx(tree, leaf, key, &found);
+
+	return found ? leaf->elems[idx] : NULL;
+}
+
+/*
+ * Add key to leaf at idx. If leaf is full, it is split in two, *split is
+ * set to the new right hand leaf and *sep to its first element.
+ */
+static void btree_leaf_insert(const ac_btree_t *tree, struct btree_leaf *leaf,
+			      u16 idx, const void *key,
+			      struct btree_node **split, void **sep)
+{
+	void *elems[BTREE_LEAF_MAX + 1];
+	struct btree_leaf *right;
+	u16 nr = leaf->node.nr;
+	u16 n;
+
+	if (nr < BTREE_LEAF_MAX) {
+		memmove(&leaf->elems[idx + 1], &leaf->elems[idx],
+			(nr - idx) * sizeof(void *));
+		leaf->elems[idx] = (void *)key;
+		leaf->node.nr++;
+		return;
+	}
+
+	memcpy(elems, leaf->elems, idx * sizeof(void *));
+	elems[idx] = (void *)key;
+	memcpy(&elems[idx + 1], &leaf->elems[idx], (nr - idx) * sizeof(void *));
+
+	right = btree_node_alloc(tree, true);
+	n = (BTREE_LEAF_MAX + 1) / 2;
+	memcpy(leaf->elems, elems, n * sizeof(void *));
+	leaf->node.nr = n;
+	memcpy(right->elems, &elems[n], (BTREE_LEAF_MAX + 1 - n) *
+	       sizeof(void *));
+	right->node.nr = BTREE_LEAF_MAX + 1 - n;
+
+	right->prev = leaf;
+	right->next = leaf->next;
+	if (leaf->next)
+		leaf->next->prev = right;
+	leaf->next = right;
+
+	*split = &right->node;
+	*sep = right->elems[0];
+}
+
+/*
+ * Add key and child to inner as ->keys[idx] & ->children[idx + 1]. If
+ * inner is full, it is split in two, *split is set to the new right hand
+ * node and *sep to the key that separates them.
+ */
+static void btree_inner_insert(const ac_btree_t *tree,
+			       struct btree_inner *inner, u16 idx, void *key,
+			       struct btree_node *child,
+			       struct btree_node **split, void **sep)
+{
+	void *keys[BTREE_INNER_MAX];
+	struct btree_node *children[BTREE_INNER_MAX + 1];
+	unsigned long counts[BTREE_INNER_MAX + 1];
+	struct btree_inner *right;
+	u16 nr = inner->node.nr;
+	u16 n;
+
+	if (nr < BTREE_INNER_MAX) {
+		memmove(&inner->keys[idx + 1], &inner->keys[idx],
+			(nr - 1 - idx) * sizeof(void *));
+		memmove(&inner->children[idx + 2], &inner->children[idx + 1],
+			(nr - 1 - idx) * sizeof(struct btree_node *));
+		memmove(&inner->counts[idx + 2], &inner->counts[idx + 1],
+			(nr - 1 - idx) * sizeof(unsigned long));
+		inner->keys[idx] = key;
+		inner->children[idx + 1] = child;
+		inner->counts[idx + 1] = btree_node_count(child);
+		inner->node.nr++;
+		return;
+	}
+
+	memcpy(keys, inner->keys, idx * sizeof(void *));
+	keys[idx] = key;
+	memcpy(&keys[idx + 1], &inner->keys[idx],
+	       (nr - 1 - idx) * sizeof(void *));
+	memcpy(children, inner->children,
+	       (idx + 1) * sizeof(struct btree_node *));
+	children[idx + 1] = child;
+	memcpy(&children[idx + 2], &inner->children[idx + 1],
+	       (nr - 1 - idx) * sizeof(struct btree_node *));
+	memcpy(counts, inner->counts, (idx + 1) * sizeof(unsigned long));
+	counts[idx + 1] = btree_node_count(child);
+	memcpy(&counts[idx + 2], &inner->counts[idx + 1],
+	       (nr - 1 - idx) * sizeof(unsigned long));
+
+	/* The left node keeps n children, the key between them moves up */
+	right = btree_node_alloc(tree, false);
+	n = (BTREE_INNER_MAX + 1) / 2;
+	memcpy(inner->keys, keys, (n - 1) * sizeof(void *));
+	memcpy(inner->children, children, n * sizeof(struct btree_node *));
+	memcpy(inner->counts, counts, n * sizeof(unsigned long));
+	inner->node.nr = n;
+	memcpy(right->keys, &keys[n], (BTREE_INNER_MAX - n) * sizeof(void *));
+	memcpy(right->children, &children[n],
+	       (BTREE_INNER_MAX + 1 - n) * sizeof(struct btree_node *));
+	memcpy(right->counts, &counts[n],
+	       (BTREE_INNER_MAX + 1 - n) * sizeof(unsigned long));
+	right->node.nr = BTREE_INNER_MAX + 1 - n;
+
+	*split = &right->node;
+	*sep = keys[n - 1];
+}
+
+/*
+ * Add key under node. If node had to be split, *split is set to the new
+ * right hand node and *sep to the key separating them.
+ *
+ * Returns the element in the tree matching key, *added is set if it was
+ * added.
+ */
+static void *btree_insert(ac_btree_t *tree, struct btree_node *node,
+			  const void *key, struct btree_node **split,
+			  void **sep, bool *added)
+{
+	struct btree_inner *inner;
+	struct btree_node *child_split = NULL;
+	void *child_sep;
+	void *elem;
+	u16 idx;
+
+	*split = NULL;
+
+	if (node->leaf) {
+		struct btree_leaf *leaf = BTREE_LEAF(node);
+		bool found;
+
+		idx = btree_leaf_idx(tree, leaf, key, &found);
+		if (found) {
+			*added = false;
+			return leaf->elems[idx];
+		}
+
+		btree_leaf_insert(tree, leaf, idx, key, split, sep);
+		*added = true;
+
+		return (void *)key;
+	}
+
+	inner = BTREE_INNER(node);
+	idx = btree_inner_idx(tree, inner, key);
+	elem = btree_insert(tree, inner->children[idx], key, &child_split,
+			    &child_sep, added);
+	if (!*added)
+		return elem;
+
+	inner->counts[idx]++;
+	if (child_split) {
+		inner->counts[idx] = btree_node_count(inner->children[idx]);
+		btree_inner_insert(tree, inner, idx, child_sep, child_split,
+				   split, sep);
+	}
+
+	return elem;
+}
+
+static void *btree_add(ac_btree_t *tree, const void *key)
+{
+	struct btree_node *split;
+	struct btree_inner *root;
+	bool added;
+	void *elem;
+	void *sep;
+
+	if (!tree->rootp) {
+		struct btree_leaf *leaf = btree_node_alloc(tree, true);
+
+		leaf->prev = NULL;
+		leaf->next = NULL;
+		leaf->elems[0] = (void *)key;
+		leaf->node.nr = 1;
+		tree->rootp = leaf;
+		tree->count = 1;
+
+		return (void *)key;
+	}
+
+	elem = btree_insert(tree, tree->rootp, key, &split, &sep, &added);
+	if (added)
+		tree->count++;
+	if (!split)
+		return elem;
+
+	/* The root was split, grow the tree by a level */
+	root = btree_node_alloc(tree, false);
+	root->children[0] = tree->rootp;
+	root->children[1] = split;
+	root->counts[0] = btree_node_count(tree->rootp);
+	root->counts[1] = btree_node_count(split);
+	root->keys[0] = sep;
+	root->node.nr = 2;
+	tree->rootp = root;
+
+	return elem;
+}
+
+/* Remove ->keys[idx] and ->children[idx + 1] from inner */
+static void btree_inner_delete(struct btree_inner *inner, u16 idx)
+{
+	u16 nr = inner->node.nr;
+
+	memmove(&inner->keys[idx], &inner->keys[idx + 1],
+		(nr - 2 - idx) * sizeof(void *));
+	memmove(&inner->children[idx + 1], &inner->children[idx + 2],
+		(nr - 2 - idx) * sizeof(struct btree_node *));
+	memmove(&inner->counts[idx + 1], &inner->counts[idx + 2],
+		(nr - 2 - idx) * sizeof(unsigned long));
+	inner->node.nr--;
+}
+
+/* Move the last entry of the left sibling of ->children[idx] into it */
+static void btree_borrow_left(struct btree_inner *parent, u16 idx)
+{
+	struct btree_node *node = parent->children[idx];
+	struct btree_node *left = parent->children[idx - 1];
+
+	if (node->leaf) {
+		struct btree_leaf *l = BTREE_LEAF(node);
+		struct btree_leaf *ll = BTREE_LEAF(left);
+
+		memmove(&l->elems[1], &l->elems[0], node->nr * sizeof(void *));
+		l->elems[0] = ll->elems[left->nr - 1];
+		parent->keys[idx - 1] = l->elems[0];
+	} else {
+		struct btree_inner *in = BTREE_INNER(node);
+		struct btree_inner *li = BTREE_INNER(left);
+
+		memmove(&in->keys[1], &in->keys[0],
+			(node->nr - 1) * sizeof(void *));
+		memmove(&in->children[1], &in->children[0],
+			node->nr * sizeof(struct btree_node *));
+		memmove(&in->counts[1], &in->counts[0],
+			node->nr * sizeof(unsigned long));
+		in->children[0] = li->children[left->nr - 1];
+		in->counts[0] = li->counts[left->nr - 1];
+		in->keys[0] = parent->keys[idx - 1];
+		parent->keys[idx - 1] = li->keys[left->nr - 2];
+	}
+
+	left->nr--;
+	node->nr++;
+
+	parent->counts[idx - 1] = btree_node_count(left);
+	parent->counts[idx] = btree_node_count(node);
+}
+
+/* Move the first entry of the right sibling of ->children[idx] into it */
+static void btree_borrow_right(struct btree_inner *parent, u16 idx)
+{
+	struct btree_node *node = parent->children[idx];
+	struct btree_node *right = parent->children[idx + 1];
+
+	if (node->leaf) {
+		struct btree_leaf *l = BTREE_LEAF(node);
+		struct btree_leaf *rl = BTREE_LEAF(right);
+
+		l->elems[node->nr] = rl->elems[0];
+		memmove(&rl->elems[0], &rl->elems[1],
+			(right->nr - 1) * sizeof(void *));
+		parent->keys[idx] = rl->elems[0];
+	} else {
+		struct btree_inner *in = BTREE_INNER(node);
+		struct btree_inner *ri = BTREE_INNER(right);
+
+		in->keys[node->nr - 1] = parent->keys[idx];
+		in->children[node->nr] = ri->children[0];
+		in->counts[node->nr] = ri->counts[0];
+		parent->keys[idx] = ri->keys[0];
+		memmove(&ri->keys[0], &ri->keys[1],
+			(right->nr - 2) * sizeof(void *));
+		memmove(&ri->children[0], &ri->children[1],
+			(right->nr - 1) * sizeof(struct btree_node *));
+		memmove(&ri->counts[0], &ri->counts[1],
+			(right->nr - 1) * sizeof(unsigned long));
+	}
+
+	right->nr--;
+	node->nr++;
+
+	parent->counts[idx] = btree_node_count(node);
+	parent->counts[idx + 1] = btree_node_count(right);
+}
+
+/* Merge ->children[idx + 1] into ->children[idx] */
+static void btree_merge(const ac_btree_t *tree, struct btree_inner *parent,
+			u16 idx)
+{
+	struct btree_node *left = parent->children[idx];
+	struct btree_node *right = parent->children[idx + 1];
+
+	if (left->leaf) {
+		struct btree_leaf *ll = BTREE_LEAF(left);
+		struct btree_leaf *rl = BTREE_LEAF(right);
+
+		memcpy(&ll->elems[left->nr], rl->elems,
+		       right->nr * sizeof(void *));
+		ll->next = rl->next;
+		if (rl->next)
+			rl->next->prev = ll;
+	} else {
+		struct btree_inner *li = BTREE_INNER(left);
+		struct btree_inner *ri = BTREE_INNER(right);
+
+		li->keys[left->nr - 1] = parent->keys[idx];
+		memcpy(&li->keys[left->nr], ri->keys,
+		       (right->nr - 1) * sizeof(void *));
+		memcpy(&li->children[left->nr], ri->children,
+		       right->nr * sizeof(struct btree_node *));
+		memcpy(&li->counts[left->nr], ri->counts,
+		       right->nr * sizeof(unsigned long));
+	}
+
+	parent->counts[idx] += parent->counts[idx + 1];
+	left->nr += right->nr;
+	btree_node_free(tree, right);
+	btree_inner_delete(parent, idx);
+}
+
+/* ->children[idx] has too few entries, borrow some or merge it */
+static void btree_rebalance(const ac_btree_t *tree,
+			    struct btree_inner *parent, u16 idx)
+{
+	if (idx > 0 && parent->children[idx - 1]->nr >
+	    btree_node_min(parent->children[idx - 1]))
+		btree_borrow_left(parent, idx);
+	else if (idx + 1 < parent->node.nr && parent->children[idx + 1]->nr >
+		 btree_node_min(parent->children[idx + 1]))
+		btree_borrow_right(parent, idx);
+	else if (idx > 0)
+		btree_merge(tree, parent, idx - 1);
+	else
+		btree_merge(tree, parent, idx);
+}
+
+/*
+ * Remove key from under node.
+ *
+ * sepp points to the separator key above node that is the first element
+ * under node, if any. As that may be the element being removed, it gets
+ * updated to the new first element.
+ *
+ * *nextp is set to the element after the removed one, or the one before
+ * it if it was the last.
+ *
+ * Returns the removed element or NULL if key wasn't found.
+ */
+static void *btree_delete(const ac_btree_t *tree, struct btree_node *node,
+			  const void *key, void **sepp, void **nextp)
+{
+	struct btree_inner *inner;
+	struct btree_node *child;
+	void *elem;
+	u16 idx;
+
+	if (node->leaf) {
+		struct btree_leaf *leaf = BTREE_LEAF(node);
+		bool found;
+
+		idx = btree_leaf_idx(tree, leaf, key, &found);
+		if (!found)
+			return NULL;
+
+		elem = leaf->elems[idx];
+		memmove(&leaf->elems[idx], &leaf->elems[idx + 1],
+			(node->nr - 1 - idx) * sizeof(void *));
+		node->nr--;
+
+		if (idx < node->nr)
+			*nextp = leaf->elems[idx];
+		else if (leaf->next)
+			*nextp = leaf->next->elems[0];
+		else if (idx > 0)
+			*nextp = leaf->elems[idx - 1];
+		else if (leaf->prev)
+			*nextp = leaf->prev->elems[leaf->prev->node.nr - 1];
+		else
+			*nextp = NULL;
+
+		if (idx == 0 && sepp && node->nr > 0)
+			*sepp = leaf->elems[0];
+
+		return elem;
+	}
+
+	inner = BTREE_INNER(node);
+	idx = btree_inner_idx(tree, inner, key);
+	child = inner->children[idx];
+	elem = btree_delete(tree, child, key,
+			    idx > 0 ? &inner->keys[idx - 1] : sepp, nextp);
+	if (!elem)
+		return NULL;
+
+	inner->counts[idx]--;
+	if (child->nr < btree_node_min(child))
+		btree_rebalance(tree, inner, idx);
+
+	return elem;
+}
+
+/*
+ * Remove key from a B+tree, the removed element is returned via elemp
+ * (NULL if it wasn't found).
+ */
+static void *btree_remove(ac_btree_t *tree, const void *key, void **elemp)
+{
+	struct btree_node *root = tree->rootp;
+	void *next;
+
+	*elemp = NULL;
+	if (!root)
+		return NULL;
+
+	*elemp = btree_delete(tree, root, key, NULL, &next);
+	if (!*elemp)
+		return NULL;
+	tree->count--;
+
+	/* Shrink the tree by a level or remove the last (empty) leaf */
+	if (!root->leaf && root->nr == 1) {
+		tree->rootp = BTREE_INNER(root)->children[0];
+		btree_node_free(tree, root);
+	} else if (root->leaf && root->nr == 0) {
+		tree->rootp = NULL;
+		btree_node_free(tree, root);
+	}
+
+	return next;
+}
+
+/* As btree_remove() but for the tsearch(3) backed binary tree */
+static void *btree_tremove(ac_btree_t *tree, const void *key, void **elemp)
+{
+	void *pnode;
+
+	*elemp = NULL;
+
+	btree_match.compar = tree->compar;
+	btree_match.matched = false;
+	pnode = tdelete(key, &tree->rootp, btree_compar_match);
+	if (!btree_match.matched)
+		return NULL;
+
+	*elemp = (void *)btree_match.node;
+	tree->count--;
+	if (!pnode || !tree->rootp)
+		return NULL;
+
+	return *(void **)pnode;
+}
+
+static void btree_free_nodes(const ac_btree_t *tree, struct btree_node *node)
+{
+	u16 i;
+
+	if (node->leaf) {
+		for (i = 0; i < node->nr; i++)
+			tree->free_node(BTREE_LEAF(node)->elems[i]);
+	} else {
+		for (i = 0; i < node->nr; i++)
+			btree_free_nodes(tree, BTREE_INNER(node)->children[i]);
+	}
+
+	free(node);
+}
+
+/*
+ * Visit each element in order. With a B+tree there are no inner elements
+ * so they're all visited as a leaf.
+ */
+static void btree_walk(const ac_btree_t *tree,
+		       void (*action)(const void *nodep, VISIT which,
+				      int depth),
+		       void (*action_r)(const void *nodep, VISIT which,
+					void *data),
+		       void *user_data)
+{
+	const struct btree_leaf *bleaf;
+	int depth;
+
+	if (!tree->rootp)
+		return;
+
+	depth = btree_height(tree->rootp);
+	for (bleaf = btree_first_leaf(tree->rootp); bleaf;
+	     bleaf = bleaf->next) {
+		u16 i;
+
+		for (i = 0; i < bleaf->node.nr; i++) {
+			if (action)
+				action(&bleaf->elems[i], leaf, depth);
+			else
+				action_r(&bleaf->elems[i], leaf, user_data);
+		}
+	}
+}
+
 /**
  * ac_btree_destroy - destroy a binary tree freeing all memory
  *
@@ -29,7 +758,29 @@ void ac_btree_destroy(const ac_btree_t *tree)
 	if (!tree)
 		return;
 
-	tdestroy(tree->rootp, tree->free_node);
+	if (tree->arena) {
+		const struct btree_leaf *bleaf;
+
+		/* The nodes and the tree itself go with the arena */
+		if (!tree->rootp || tree->free_node == null_free_node)
+			return;
+
+		for (bleaf = btree_first_leaf(tree->rootp); bleaf;
+		     bleaf = bleaf->next) {
+			u16 i;
+
+			for (i = 0; i < bleaf->node.nr; i++)
+				tree->free_node(bleaf->elems[i]);
+		}
+		return;
+	}
+
+	if (tree->type == AC_BTREE_TYPE_BPLUS) {
+		if (tree->rootp)
+			btree_free_nodes(tree, tree->rootp);
+	} else {
+		tdestroy(tree->rootp, tree->free_node);
+	}
 
 	free((void *)tree);
 }
@@ -50,6 +801,9 @@ void *ac_btree_new(int (*compar)(const void *, const void *),
 
 	tree->rootp = NULL;
 	tree->compar = compar;
+	tree->type = AC_BTREE_TYPE_BINARY;
+	tree->count = 0;
+	tree->arena = NULL;
 
 	if (!free_node)
 		tree->free_node = null_free_node;
@@ -59,17 +813,85 @@ void *ac_btree_new(int (*compar)(const void *, const void *),
 	return tree;
 }
 
+/**
+ * ac_btree_new_bplus - create a new B+tree
+ *
+ * @compar: A comparison function. Function should return an integer less
+ *          than, equal to or greater than zero if the first argument is
+ *          considered to be respectively less than, equal to or greater
+ *          than the second
+ * @free_node: Pointer to function called to free a nodes memory. Can be NULL
+ *
+ * This is used exactly like a tree created with ac_btree_new(), but the
+ * elements are stored in wide, cache line aligned nodes, so a lookup
+ * touches a handful of cache lines rather than one per level of a binary
+ * tree.
+ *
+ * Returns:
+ *
+ * A pointer to the new tree. Should be free'd with ac_btree_destroy()
+ */
+ac_btree_t *ac_btree_new_bplus(int (*compar)(const void *, const void *),
+			       void (*free_node)(void *nodep))
+{
+	ac_btree_t *tree = ac_btree_new(compar, free_node);
+
+	tree->type = AC_BTREE_TYPE_BPLUS;
+
+	return tree;
+}
+
+/**
+ * ac_btree_new_arena - create a new B+tree in an arena
+ *
+ * @compar: A comparison function, as for ac_btree_new()
+ * @free_node: Pointer to function called to free a nodes memory. Can be NULL
+ * @arena: The arena to allocate the tree and its nodes from
+ *
+ * This creates a B+tree (see ac_btree_new_bplus()) whose memory all comes
+ * from @arena. Without a @free_node function, ac_btree_destroy() has
+ * nothing to do and the tree is released along with everything else in
+ * the arena by ac_arena_reset() or ac_arena_destroy().
+ *
+ * Tree nodes free'd by removing elements aren't reused, their memory is
+ * only given back with the arena, so this suits short lived trees.
+ *
+ * Returns:
+ *
+ * A pointer to the new tree
+ */
+ac_btree_t *ac_btree_new_arena(int (*compar)(const void *, const void *),
+			       void (*free_node)(void *nodep),
+			       ac_arena_t *arena)
+{
+	ac_btree_t *tree = ac_arena_alloc(arena, sizeof(ac_btree_t));
+
+	tree->rootp = NULL;
+	tree->compar = compar;
+	tree->free_node = free_node ? free_node : null_free_node;
+	tree->type = AC_BTREE_TYPE_BPLUS;
+	tree->count = 0;
+	tree->arena = arena;
+
+	return tree;
+}
+
 /**
  * ac_btree_foreach - iterate over the tree
  *
  * @tree: The binary tree to operate on
  * @action: Function to be called for each node
+ *
+ * With a B+tree, each node is visited once, in order, as a leaf.
  */
 void ac_btree_foreach(const ac_btree_t *tree,
 		      void (*action)(const void *nodep, VISIT which,
 				     int depth))
 {
-	twalk(tree->rootp, action);
+	if (tree->type == AC_BTREE_TYPE_BPLUS)
+		btree_walk(tree, action, NULL, NULL);
+	else
+		twalk(tree->rootp, action);
 }
 
 /**
@@ -78,13 +900,18 @@ void ac_btree_foreach(const ac_btree_t *tree,
  * @tree: The binary tree to operate on
  * @action: Function to be called for each node
  * @user_data: Optional user data argument passed to action() as closure
+ *
+ * With a B+tree, each node is visited once, in order, as a leaf.
  */
 void ac_btree_foreach_data(const ac_btree_t *tree,
 			   void (*action)(const void *nodep, VISIT which,
 					  void *data),
 			   void *user_data)
 {
-	twalk_r(tree->rootp, action, user_data);
+	if (tree->type == AC_BTREE_TYPE_BPLUS)
+		btree_walk(tree, NULL, action, user_data);
+	else
+		twalk_r(tree->rootp, action, user_data);
 }
 
 /**
@@ -99,7 +926,12 @@ void ac_btree_foreach_data(const ac_btree_t *tree,
  */
 void *ac_btree_lookup(const ac_btree_t *tree, const void *key)
 {
-	void *node = tfind(key, &tree->rootp, tree->compar);
+	void *node;
+
+	if (tree->type == AC_BTREE_TYPE_BPLUS)
+		return btree_lookup(tree, key);
+
+	node = tfind(key, &tree->rootp, tree->compar);
 
 	if (!node)
 		return NULL;
@@ -120,7 +952,18 @@ void *ac_btree_lookup(const ac_btree_t *tree, const void *key)
  */
 void *ac_btree_add(ac_btree_t *tree, const void *key)
 {
-	return *(void **)tsearch(key, &tree->rootp, tree->compar);
+	void *node;
+
+	if (tree->type == AC_BTREE_TYPE_BPLUS)
+		return btree_add(tree, key);
+
+	btree_match.compar = tree->compar;
+	btree_match.matched = false;
+	node = tsearch(key, &tree->rootp, btree_compar_match);
+	if (!btree_match.matched)
+		tree->count++;
+
+	return *(void **)node;
 }
 
 /**
@@ -136,21 +979,181 @@ void *ac_btree_add(ac_btree_t *tree, const void *key)
  *
  * You can make a call to ac_btree_is_empty() to find out which of the
  * above
+ *
+ * With a B+tree, the node returned is the one after the removed one (or
+ * the one before if it was the last) instead of the parent
  */
 void *ac_btree_remove(ac_btree_t *tree, const void *key)
 {
-	void *node = ac_btree_lookup(tree, key);
-	void *pnode;
+	void *node;
+	void *next;
 
-	if (!node)
-		return NULL;
+	if (tree->type == AC_BTREE_TYPE_BPLUS)
+		next = btree_remove(tree, key, &node);
+	else
+		next = btree_tremove(tree, key, &node);
 
-	pnode = tdelete(key, &tree->rootp, tree->compar);
-	tree->free_node(node);
-	if (!pnode || !tree->rootp)
-		return NULL;
+	if (node)
+		tree->free_node(node);
 
-	return *(void **)pnode;
+	return next;
+}
+
+/**
+ * ac_btree_steal - remove a node from the tree without freeing it
+ *
+ * @tree: The tree to remove the node from
+ * @key: The item to be removed
+ *
+ * Unlike ac_btree_remove(), the trees free_node function isn't called on
+ * the removed node, it is handed back to the caller, e.g to be moved to
+ * another tree.
+ *
+ * Returns:
+ *
+ * The removed node or NULL if it wasn't found
+ */
+void *ac_btree_steal(ac_btree_t *tree, const void *key)
+{
+	void *node;
+
+	if (tree->type == AC_BTREE_TYPE_BPLUS)
+		btree_remove(tree, key, &node);
+	else
+		btree_tremove(tree, key, &node);
+
+	return node;
+}
+
+/*
+ * Split nr items into the fewest groups of at most max, as evenly as
+ * possible. Returns the number of groups, *base is set to the size of
+ * the smaller groups and *extra to how many groups have one more.
+ */
+static size_t btree_split_even(size_t nr, size_t max, size_t *base,
+			       size_t *extra)
+{
+	size_t nr_groups = (nr + max - 1) / max;
+
+	*base = nr / nr_groups;
+	*extra = nr % nr_groups;
+
+	return nr_groups;
+}
+
+/*
+ * Build a B+tree bottom up from sorted elements. Each level uses the fewest
+ * nodes that will hold it, with the items spread evenly across them.
+ */
+static void btree_build(ac_btree_t *tree, void * const *elems, size_t nr)
+{
+	struct btree_node **nodes;
+	struct btree_leaf *prev = NULL;
+	void **firsts;
+	size_t nr_nodes;
+	size_t base;
+	size_t extra;
+	size_t i;
+
+	nr_nodes = btree_split_even(nr, BTREE_LEAF_MAX, &base, &extra);
+	nodes = malloc(nr_nodes * sizeof(struct btree_node *));
+	firsts = malloc(nr_nodes * sizeof(void *));
+
+	for (i = 0; i < nr_nodes; i++) {
+		struct btree_leaf *leaf = btree_node_alloc(tree, true);
+		u16 n = base + (i < extra);
+
+		memcpy(leaf->elems, elems, n * sizeof(void *));
+		leaf->node.nr = n;
+		leaf->prev = prev;
+		leaf->next = NULL;
+		if (prev)
+			prev->next = leaf;
+		prev = leaf;
+
+		nodes[i] = &leaf->node;
+		firsts[i] = elems[0];
+		elems += n;
+	}
+
+	/* Each level is built in place over the one below it */
+	while (nr_nodes > 1) {
+		size_t nr_parents;
+		size_t c = 0;
+
+		nr_parents = btree_split_even(nr_nodes, BTREE_INNER_MAX, &base,
+					      &extra);
+		for (i = 0; i < nr_parents; i++) {
+			struct btree_inner *inner = btree_node_alloc(tree, false);
+			u16 n = base + (i < extra);
+			u16 j;
+
+			for (j = 0; j < n; j++, c++) {
+				inner->children[j] = nodes[c];
+				inner->counts[j] = btree_node_count(nodes[c]);
+				if (j > 0)
+					inner->keys[j - 1] = firsts[c];
+			}
+			inner->node.nr = n;
+
+			firsts[i] = firsts[c - n];
+			nodes[i] = &inner->node;
+		}
+		nr_nodes = nr_parents;
+	}
+
+	tree->rootp = nodes[0];
+	tree->count = nr;
+
+	free(nodes);
+	free(firsts);
+}
+
+/**
+ * ac_btree_build_sorted - fill an empty tree from sorted nodes
+ *
+ * @tree: The (empty) tree to fill
+ * @nodes: An array of @nr nodes, sorted in ascending order according to the
+ *         trees compar function with no duplicates
+ * @nr: The number of nodes
+ *
+ * For a B+tree, the tree is built bottom up in O(n) time rather than adding
+ * each node in turn, each level using the fewest nodes possible with the
+ * nodes spread evenly across them. For a binary tree, the nodes are simply
+ * added one at a time.
+ *
+ * Returns:
+ *
+ * 0 on success or -1 if the tree isn't empty or @nodes isn't sorted (errno
+ * will be set to EINVAL)
+ */
+int ac_btree_build_sorted(ac_btree_t *tree, void * const *nodes, size_t nr)
+{
+	size_t i;
+
+	if (tree->rootp)
+		goto out_einval;
+	for (i = 1; i < nr; i++) {
+		if (tree->compar(nodes[i - 1], nodes[i]) >= 0)
+			goto out_einval;
+	}
+
+	if (nr == 0)
+		return 0;
+
+	if (tree->type == AC_BTREE_TYPE_BPLUS) {
+		btree_build(tree, nodes, nr);
+		return 0;
+	}
+
+	for (i = 0; i < nr; i++)
+		ac_btree_add(tree, nodes[i]);
+
+	return 0;
+
+out_einval:
+	errno = EINVAL;
+	return -1;
 }
 
 /**
@@ -166,3 +1169,343 @@ bool ac_btree_is_empty(const ac_btree_t *tree)
 {
 	return !tree->rootp;
 }
+
+/**
+ * ac_btree_count - get the number of nodes in the tree
+ *
+ * @tree: The tree to check
+ *
+ * Returns:
+ *
+ * The number of nodes in the tree
+ */
+unsigned long ac_btree_count(const ac_btree_t *tree)
+{
+	return tree->count;
+}
+
+/**
+ * ac_btree_rank - get the position of a key in a B+tree
+ *
+ * @tree: The tree to work on
+ * @key: The item to be matched
+ *
+ * This takes O(log n) time, using the node counts kept in the tree.
+ *
+ * Returns:
+ *
+ * The number of nodes in the tree less than @key, which is the (0 based)
+ * index of @key if it's in the tree. -1 if the tree isn't a B+tree (errno
+ * will be set to ENOTSUP)
+ */
+long ac_btree_rank(const ac_btree_t *tree, const void *key)
+{
+	const struct btree_node *node = tree->rootp;
+	unsigned long rank = 0;
+	bool found;
+
+	if (tree->type != AC_BTREE_TYPE_BPLUS) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (!node)
+		return 0;
+
+	while (!node->leaf) {
+		const struct btree_inner *inner = BTREE_INNER(node);
+		u16 idx = btree_inner_idx(tree, inner, key);
+		u16 i;
+
+		for (i = 0; i < idx; i++)
+			rank += inner->counts[i];
+		node = inner->children[idx];
+	}
+
+	return rank + btree_leaf_idx(tree, BTREE_LEAF(node), key, &found);
+}
+
+/**
+ * ac_btree_select - get the node at a given position in a B+tree
+ *
+ * @tree: The tree to work on
+ * @n: The (0 based) index of the node to get, in sorted order
+ *
+ * This takes O(log n) time, using the node counts kept in the tree.
+ *
+ * Returns:
+ *
+ * A pointer to the @n'th node or NULL if @n is out of range or the tree
+ * isn't a B+tree (errno will be set to ENOTSUP)
+ */
+void *ac_btree_select(const ac_btree_t *tree, unsigned long n)
+{
+	const struct btree_node *node = tree->rootp;
+
+	if (tree->type != AC_BTREE_TYPE_BPLUS) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	if (n >= tree->count)
+		return NULL;
+
+	while (!node->leaf) {
+		const struct btree_inner *inner = BTREE_INNER(node);
+		u16 i = 0;
+
+		while (n >= inner->counts[i]) {
+			n -= inner->counts[i];
+			i++;
+		}
+		node = inner->children[i];
+	}
+
+	return BTREE_LEAF(node)->elems[n];
+}
+
+/*
+ * Point the cursor at ->elems[idx] of leaf, moving on to the next leaf if
+ * idx is past the end.
+ *
+ * Returns the element at the cursor or NULL if we've run off the end.
+ */
+static void *btree_cursor_set(ac_btree_cursor_t *cur,
+			      const struct btree_leaf *leaf, u16 idx)
+{
+	if (leaf && idx >= leaf->node.nr) {
+		leaf = leaf->next;
+		idx = 0;
+	}
+
+	cur->leaf = leaf;
+	cur->idx = idx;
+
+	return leaf ? leaf->elems[idx] : NULL;
+}
+
+/* Cursors and ranges are only supported on B+trees */
+static bool btree_cursor_init(ac_btree_cursor_t *cur, const ac_btree_t *tree)
+{
+	cur->tree = tree;
+	cur->leaf = NULL;
+	cur->idx = 0;
+
+	if (tree->type != AC_BTREE_TYPE_BPLUS) {
+		errno = ENOTSUP;
+		return false;
+	}
+
+	return tree->rootp;
+}
+
+/**
+ * ac_btree_first - get the first node in a B+tree
+ *
+ * @tree: The tree to work on
+ * @cur: The cursor to set to the first node
+ *
+ * The cursor can then be moved with ac_btree_next() & ac_btree_prev().
+ * Cursors are invalidated by adding to or removing from the tree.
+ *
+ * Cursors are only supported on B+trees, see ac_btree_new_bplus().
+ *
+ * Returns:
+ *
+ * A pointer to the first node or NULL if the tree is empty or isn't a
+ * B+tree (errno will be set to ENOTSUP)
+ */
+void *ac_btree_first(const ac_btree_t *tree, ac_btree_cursor_t *cur)
+{
+	if (!btree_cursor_init(cur, tree))
+		return NULL;
+
+	return btree_cursor_set(cur, btree_first_leaf(tree->rootp), 0);
+}
+
+/**
+ * ac_btree_last - get the last node in a B+tree
+ *
+ * @tree: The tree to work on
+ * @cur: The cursor to set to the last node
+ *
+ * See ac_btree_first()
+ *
+ * Returns:
+ *
+ * A pointer to the last node or NULL if the tree is empty or isn't a
+ * B+tree (errno will be set to ENOTSUP)
+ */
+void *ac_btree_last(const ac_btree_t *tree, ac_btree_cursor_t *cur)
+{
+	const struct btree_leaf *leaf;
+
+	if (!btree_cursor_init(cur, tree))
+		return NULL;
+
+	leaf = btree_last_leaf(tree->rootp);
+
+	return btree_cursor_set(cur, leaf, leaf->node.nr - 1);
+}
+
+/**
+ * ac_btree_lower_bound - find the first node not less than a key
+ *
+ * @tree: The tree to work on
+ * @key: The item to be matched
+ * @cur: The cursor to set to the found node
+ *
+ * See ac_btree_first()
+ *
+ * Returns:
+ *
+ * A pointer to the first node that is greater than or equal to @key or
+ * NULL if there isn't one or the tree isn't a B+tree (errno will be set
+ * to ENOTSUP)
+ */
+void *ac_btree_lower_bound(const ac_btree_t *tree, const void *key,
+			   ac_btree_cursor_t *cur)
+{
+	const struct btree_leaf *leaf;
+	bool found;
+	u16 idx;
+
+	if (!btree_cursor_init(cur, tree))
+		return NULL;
+
+	leaf = btree_find_leaf(tree, key);
+	idx = btree_leaf_idx(tree, leaf, key, &found);
+
+	return btree_cursor_set(cur, leaf, idx);
+}
+
+/**
+ * ac_btree_upper_bound - find the first node greater than a key
+ *
+ * @tree: The tree to work on
+ * @key: The item to be matched
+ * @cur: The cursor to set to the found node
+ *
+ * See ac_btree_first()
+ *
+ * Returns:
+ *
+ * A pointer to the first node that is greater than @key or NULL if there
+ * isn't one or the tree isn't a B+tree (errno will be set to ENOTSUP)
+ */
+void *ac_btree_upper_bound(const ac_btree_t *tree, const void *key,
+			   ac_btree_cursor_t *cur)
+{
+	const struct btree_leaf *leaf;
+	bool found;
+	u16 idx;
+
+	if (!btree_cursor_init(cur, tree))
+		return NULL;
+
+	leaf = btree_find_leaf(tree, key);
+	idx = btree_leaf_idx(tree, leaf, key, &found);
+	if (found)
+		idx++;
+
+	return btree_cursor_set(cur, leaf, idx);
+}
+
+/**
+ * ac_btree_next - move a cursor on to the next node
+ *
+ * @cur: The cursor to move
+ *
+ * Returns:
+ *
+ * A pointer to the next node or NULL if there are no more
+ */
+void *ac_btree_next(ac_btree_cursor_t *cur)
+{
+	if (!cur->leaf)
+		return NULL;
+
+	return btree_cursor_set(cur, cur->leaf, cur->idx + 1);
+}
+
+/**
+ * ac_btree_prev - move a cursor back to the previous node
+ *
+ * @cur: The cursor to move
+ *
+ * Returns:
+ *
+ * A pointer to the previous node or NULL if there are no more
+ */
+void *ac_btree_prev(ac_btree_cursor_t *cur)
+{
+	const struct btree_leaf *leaf = cur->leaf;
+
+	if (!leaf)
+		return NULL;
+
+	if (cur->idx > 0)
+		return btree_cursor_set(cur, leaf, cur->idx - 1);
+
+	leaf = leaf->prev;
+	if (!leaf) {
+		cur->leaf = NULL;
+		return NULL;
+	}
+
+	return btree_cursor_set(cur, leaf, leaf->node.nr - 1);
+}
+
+/**
+ * ac_btree_range_init - initialise an iterator over a range of a B+tree
+ *
+ * @range: The range iterator to initialise
+ * @tree: The tree to iterate over
+ * @lo: The first node is the first one greater than or equal to @lo, NULL
+ *      to start from the first node in the tree
+ * @hi: The iteration stops before the first node greater than or equal to
+ *      @hi, NULL to carry on to the end of the tree
+ *
+ * Only the nodes in the range [@lo, @hi) are looked at, the rest of the
+ * tree isn't visited.
+ *
+ * See ac_btree_first()
+ */
+void ac_btree_range_init(ac_btree_range_t *range, const ac_btree_t *tree,
+			 const void *lo, const void *hi)
+{
+	range->hi = hi;
+
+	if (lo)
+		ac_btree_lower_bound(tree, lo, &range->cur);
+	else
+		ac_btree_first(tree, &range->cur);
+}
+
+/**
+ * ac_btree_range_next - get the next node from a range iterator
+ *
+ * @range: The range iterator to work on
+ *
+ * Returns:
+ *
+ * A pointer to the next node in the range or NULL when the end of the
+ * range has been reached
+ */
+void *ac_btree_range_next(ac_btree_range_t *range)
+{
+	ac_btree_cursor_t *cur = &range->cur;
+	const struct btree_leaf *leaf = cur->leaf;
+	void *elem;
+
+	if (!leaf)
+		return NULL;
+
+	elem = leaf->elems[cur->idx];
+	if (range->hi && cur->tree->compar(range->hi, elem) <= 0) {
+		cur->leaf = NULL;
+		return NULL;
+	}
+
+	btree_cursor_set(cur, leaf, cur->idx + 1);
+
+	return elem;
+}
@@ -0,0 +1,356 @@
+/* SPDX-License-Identifier: LGPL-2.1 */
+
+/*
+ * ac_btree_rcu.c - Ordered tree with lock-free lookups
+ *
+ * This is a skip list for read mostly data, used like an ac_btree_t.
+ * Writers are serialised by a mutex and publish their changes with release
+ * stores, lookups and range walks take no locks and do no atomic
+ * read-modify-write operations.
+ *
+ * A new node is linked in from the bottom level up and a removed node is
+ * unlinked from the top level down, a removed node keeps its own forward
+ * pointers so a reader sat on it carries on from where it was. Removed
+ * nodes are free'd once no reader can be looking at them, see ac_rcu.c
+ *
+ * Copyright (c) 2026	Andrew Clayton <ac@sigsegv.uk>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "include/libac.h"
+#include "rcu.h"
+
+/* With a 1 in 4 chance of going up a level, enough for 4^16 nodes */
+#define BTREE_RCU_MAX_LEVEL	16
+
+struct ac_btree_rcu_node {
+	void *elem;
+
+	ac_btree_rcu_t *tree;
+	struct rcu_head rcu;
+
+	u8 height;
+	struct ac_btree_rcu_node *next[];
+};
+
+static struct ac_btree_rcu_node *btree_rcu_node_new(ac_btree_rcu_t *tree,
+						    void *elem, u8 height)
+{
+	struct ac_btree_rcu_node *node;
+	u8 i;
+
+	node = malloc(sizeof(struct ac_btree_rcu_node) +
+		      height * sizeof(struct ac_btree_rcu_node *));
+	node->elem = elem;
+	node->tree = tree;
+	node->height = height;
+	for (i = 0; i < height; i++)
+		node->next[i] = NULL;
+
+	return node;
+}
+
+static void btree_rcu_free_node(struct rcu_head *head)
+{
+	struct ac_btree_rcu_node *node = container_of(
+					head, struct ac_btree_rcu_node, rcu);
+
+	if (node->tree->free_node)
+		node->tree->free_node(node->elem);
+	free(node);
+}
+
+/*
+ * Pick a height for a new node, each level up has a 1 in 4 chance.
+ *
+ * Called with tree->lock held.
+ */
+static u8 btree_rcu_random_height(ac_btree_rcu_t *tree)
+{
+	u64 x = tree->seed;
+
+	/* xorshift64 */
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	tree->seed = x;
+
+	x |= 1ULL << (2 * (BTREE_RCU_MAX_LEVEL - 1));
+
+	return 1 + __builtin_ctzll(x) / 2;
+}
+
+/*
+ * Find the node for key (if any), filling in preds with the last node
+ * before key on each level.
+ *
+ * Called with tree->lock held.
+ */
+static struct ac_btree_rcu_node *btree_rcu_find(
+					const ac_btree_rcu_t *tree,
+					const void *key,
+					struct ac_btree_rcu_node **preds)
+{
+	struct ac_btree_rcu_node *x = tree->head;
+	struct ac_btree_rcu_node *node;
+	int i;
+
+	for (i = tree->level - 1; i >= 0; i--) {
+		while ((node = x->next[i]) != NULL &&
+		       tree->compar(node->elem, key) < 0)
+			x = node;
+		preds[i] = x;
+	}
+
+	node = x->next[0];
+	if (node && tree->compar(node->elem, key) == 0)
+		return node;
+
+	return NULL;
+}
+
+/*
+ * Find the first node greater than or equal to key, NULL key for the
+ * first node. Called from within a read-side critical section.
+ */
+static const struct ac_btree_rcu_node *btree_rcu_lower_bound(
+					const ac_btree_rcu_t *tree,
+					const void *key)
+{
+	const struct ac_btree_rcu_node *x = tree->head;
+	const struct ac_btree_rcu_node *node;
+	int i;
+
+	if (!key)
+		return __atomic_load_n(&x->next[0], __ATOMIC_ACQUIRE);
+
+	for (i = __atomic_load_n(&tree->level, __ATOMIC_RELAXED) - 1; i >= 0;
+	     i--) {
+		while ((node = __atomic_load_n(&x->next[i],
+					       __ATOMIC_ACQUIRE)) != NULL &&
+		       tree->compar(node->elem, key) < 0)
+			x = node;
+	}
+
+	return __atomic_load_n(&x->next[0], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * ac_btree_rcu_new - create a new ordered tree with lock-free lookups
+ *
+ * @compar: A function to compare two nodes, as for ac_btree_new()
+ * @free_node: Optional pointer to a function to free a node, this is
+ *             called deferred, once no reader can still be looking at it
+ *
+ * Returns:
+ *
+ * A pointer to a newly created tree. Should be free'd with
+ * ac_btree_rcu_destroy()
+ */
+ac_btree_rcu_t *ac_btree_rcu_new(int (*compar)(const void *, const void *),
+				 void (*free_node)(void *nodep))
+{
+	ac_btree_rcu_t *tree = malloc(sizeof(ac_btree_rcu_t));
+
+	tree->head = btree_rcu_node_new(tree, NULL, BTREE_RCU_MAX_LEVEL);
+	tree->level = 1;
+	tree->count = 0;
+	tree->seed = (u64)(uintptr_t)tree | 1;
+	pthread_mutex_init(&tree->lock, NULL);
+	tree->compar = compar;
+	tree->free_node = free_node;
+
+	return tree;
+}
+
+/**
+ * ac_btree_rcu_add - add a node to the tree
+ *
+ * @tree: The tree to add the node to
+ * @node: The node to add
+ *
+ * Returns:
+ *
+ * A pointer to the node in the tree, this will be an already existing node
+ * that compares equal to @node if there is one (in which case @node isn't
+ * added)
+ */
+void *ac_btree_rcu_add(ac_btree_rcu_t *tree, void *node)
+{
+	struct ac_btree_rcu_node *preds[BTREE_RCU_MAX_LEVEL];
+	struct ac_btree_rcu_node *new;
+	struct ac_btree_rcu_node *old;
+	u8 height;
+	u8 i;
+
+	pthread_mutex_lock(&tree->lock);
+	old = btree_rcu_find(tree, node, preds);
+	if (old) {
+		pthread_mutex_unlock(&tree->lock);
+		return old->elem;
+	}
+
+	height = btree_rcu_random_height(tree);
+	for (i = tree->level; i < height; i++)
+		preds[i] = tree->head;
+
+	new = btree_rcu_node_new(tree, node, height);
+	for (i = 0; i < height; i++)
+		new->next[i] = preds[i]->next[i];
+	/* Once it's in the bottom level, it's in the tree */
+	for (i = 0; i < height; i++)
+		__atomic_store_n(&preds[i]->next[i], new, __ATOMIC_RELEASE);
+
+	if (height > tree->level)
+		__atomic_store_n(&tree->level, height, __ATOMIC_RELAXED);
+	__atomic_store_n(&tree->count, tree->count + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&tree->lock);
+
+	return node;
+}
+
+/**
+ * ac_btree_rcu_remove - remove a node from the tree
+ *
+ * @tree: The tree to remove the node from
+ * @key: The item to be removed
+ *
+ * The node is free'd once no readers are using it.
+ *
+ * Returns:
+ *
+ * true if the node was removed, false otherwise
+ */
+bool ac_btree_rcu_remove(ac_btree_rcu_t *tree, const void *key)
+{
+	struct ac_btree_rcu_node *preds[BTREE_RCU_MAX_LEVEL];
+	struct ac_btree_rcu_node *node;
+	int i;
+
+	pthread_mutex_lock(&tree->lock);
+	node = btree_rcu_find(tree, key, preds);
+	if (!node) {
+		pthread_mutex_unlock(&tree->lock);
+		return false;
+	}
+
+	for (i = node->height - 1; i >= 0; i--)
+		__atomic_store_n(&preds[i]->next[i], node->next[i],
+				 __ATOMIC_RELEASE);
+	rcu_retire(&node->rcu, btree_rcu_free_node);
+	__atomic_store_n(&tree->count, tree->count - 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&tree->lock);
+
+	rcu_reclaim();
+
+	return true;
+}
+
+/**
+ * ac_btree_rcu_lookup - lookup a node in the tree
+ *
+ * @tree: The tree to search
+ * @key: The item to find
+ *
+ * This takes no locks and does no atomic read-modify-write operations.
+ *
+ * If the tree has a free_node function, the lookup and any use of the
+ * returned node should be done between ac_rcu_read_lock() and
+ * ac_rcu_read_unlock(), otherwise it may be free'd from under you.
+ *
+ * Returns:
+ *
+ * A pointer to the found node or NULL if it wasn't found
+ */
+void *ac_btree_rcu_lookup(const ac_btree_rcu_t *tree, const void *key)
+{
+	const struct ac_btree_rcu_node *node;
+	void *elem = NULL;
+
+	ac_rcu_read_lock();
+	node = btree_rcu_lower_bound(tree, key);
+	if (node && tree->compar(node->elem, key) == 0)
+		elem = node->elem;
+	ac_rcu_read_unlock();
+
+	return elem;
+}
+
+/**
+ * ac_btree_rcu_range - iterate over a range of nodes in order
+ *
+ * @tree: The tree to iterate over
+ * @lo: Start from the first node greater than or equal to @lo, NULL to
+ *      start from the first node in the tree
+ * @hi: Stop before the first node greater than or equal to @hi, NULL to
+ *      carry on to the end of the tree
+ * @action: A pointer to a function to call for each node in [@lo, @hi).
+ *          This will get the node and optional user supplied data as
+ *          arguments
+ * @user_data: Optional pointer to data to pass to the above function
+ *
+ * This runs as a reader, nodes added or removed by other threads while
+ * iterating may or may not be seen, but those that are, are seen in order.
+ */
+void ac_btree_rcu_range(const ac_btree_rcu_t *tree, const void *lo,
+			const void *hi,
+			void (*action)(void *node, void *user_data),
+			void *user_data)
+{
+	const struct ac_btree_rcu_node *node;
+
+	ac_rcu_read_lock();
+	node = btree_rcu_lower_bound(tree, lo);
+	while (node) {
+		if (hi && tree->compar(node->elem, hi) >= 0)
+			break;
+		action(node->elem, user_data);
+		node = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+	}
+	ac_rcu_read_unlock();
+}
+
+/**
+ * ac_btree_rcu_count - get the number of nodes in the tree
+ *
+ * @tree: The tree to get the node count of
+ *
+ * Returns:
+ *
+ * The number of nodes in the tree
+ */
+unsigned long ac_btree_rcu_count(const ac_btree_rcu_t *tree)
+{
+	return __atomic_load_n(&tree->count, __ATOMIC_RELAXED);
+}
+
+/**
+ * ac_btree_rcu_destroy - destroy the given tree
+ *
+ * @tree: The tree to destroy/free
+ *
+ * No other thread may be using the tree at this point. Any deferred
+ * free's are completed first.
+ */
+void ac_btree_rcu_destroy(const ac_btree_rcu_t *tree)
+{
+	struct ac_btree_rcu_node *node = tree->head;
+
+	ac_rcu_barrier();
+
+	while (node) {
+		struct ac_btree_rcu_node *next = node->next[0];
+
+		if (node != tree->head && tree->free_node)
+			tree->free_node(node->elem);
+		free(node);
+		node = next;
+	}
+
+	pthread_mutex_destroy((pthread_mutex_t *)&tree->lock);
+	free((void *)tree);
+}
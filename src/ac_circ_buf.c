@@ -5,6 +5,17 @@
  *
  * This can store either pointers to data or copies of the data.
  *
+ * The head is only written by the producer and the tail by the consumer,
+ * each with a release store that's paired with an acquire load on the
+ * other side. They live on separate cache lines along with the producers
+ * (consumers) last seen copy of the tail (head), so in the single producer
+ * / single consumer mode, a push and a pop normally only touch their own
+ * cache line plus the slot.
+ *
+ * A mirrored buffer has its memory mapped twice, back to back, so any run
+ * of items starting in the buffer is contiguous in memory, even when it
+ * wraps around.
+ *
  * Based on include/linux/circ_buf.h from
  * https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/tree
  *
@@ -16,59 +27,108 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
 
 #include "include/libac.h"
 
 /* Buffer type; storing pointers or copying data */
 enum { PTR_BUF = 0, CPY_BUF };
 
+/* Buffer flags */
+#define CIRC_BUF_SPSC		0x01
+#define CIRC_BUF_MIRRORED	0x02
+
 /*
- * How many items are in the buffer
- *
- * When storing pointers ->elem_sz will be 1
+ * A slot in a multi producer/consumer buffer. When ->seq equals the
+ * position of the slot, it is free for that push, when it equals the
+ * position + 1 it holds the item for that pop.
  */
-static inline u32 circ_count(const ac_circ_buf_t *cbuf)
-{
-	return ((cbuf->head - cbuf->tail) / cbuf->elem_sz) & (cbuf->size - 1);
-}
+struct circ_mpmc_slot {
+	u64 seq;
+	unsigned char data[];
+};
 
 /*
- * How much free space is in the buffer, 0..size-1
- *
- * When storing pointers ->elem_sz will be 1
+ * The head and tail are free running 64 bit item counts, they're only
+ * masked down to a slot when accessing the buffer.
  */
-static inline u32 circ_space(const ac_circ_buf_t *cbuf)
+
+/* How many items are in the buffer */
+static inline u32 circ_count(u64 head, u64 tail)
 {
-	return ((cbuf->tail - (cbuf->head + cbuf->elem_sz)) / cbuf->elem_sz) &
-	       (cbuf->size - 1);
+	return head - tail;
+}
+
+/* How much free space is in the buffer, 0..size */
+static inline u32 circ_space(const ac_circ_buf_t *cbuf, u64 head, u64 tail)
+{
+	return cbuf->size - (head - tail);
+}
+
+/* The address of the slot for item idx */
+static inline void *circ_slot(const ac_circ_buf_t *cbuf, u64 idx)
+{
+	return (char *)cbuf->buf.cpy_buf +
+	       (size_t)(idx & (cbuf->size - 1)) * cbuf->elem_sz;
 }
 
 /*
- * How many contiguous items are in the buffer without wrapping
- * around
- *
- * When storing pointers ->elem_sz will be 1
+ * The producer works from its last seen copy of the tail and only goes
+ * back to the real thing when that doesn't show enough space. It can only
+ * be out of date by showing too little space.
  */
-static inline u32 circ_count_to_end(const ac_circ_buf_t *cbuf)
+static inline u64 circ_prod_tail(ac_circ_buf_t *cbuf)
+{
+	cbuf->tail_cache = __atomic_load_n(&cbuf->tail, __ATOMIC_ACQUIRE);
+
+	return cbuf->tail_cache;
+}
+
+/* Likewise for the consumer with the head */
+static inline u64 circ_cons_head(ac_circ_buf_t *cbuf)
 {
-	u32 end = cbuf->size - (cbuf->tail / cbuf->elem_sz);
-	u32 n = ((cbuf->head / cbuf->elem_sz) + end) & (cbuf->size - 1);
+	cbuf->head_cache = __atomic_load_n(&cbuf->head, __ATOMIC_ACQUIRE);
 
-	return n < end ? n : end;
+	return cbuf->head_cache;
 }
 
 /*
- * How much contiguous free space is in the buffer without
- * wrapping around
- *
- * When storing pointers ->elem_sz will be 1
+ * Describe count items starting at item idx as up to two spans, the
+ * second one being from the start of the buffer if they wrap.
  */
-static inline u32 circ_space_to_end(const ac_circ_buf_t *cbuf)
+static void circ_spans(const ac_circ_buf_t *cbuf, u64 idx, u32 count,
+		       ac_circ_buf_span_t *span)
+{
+	u32 to_end = cbuf->size - (idx & (cbuf->size - 1));
+
+	/* The start of the buffer is mapped again after its end */
+	if (cbuf->flags & CIRC_BUF_MIRRORED)
+		to_end = count;
+
+	span[0].nr = count < to_end ? count : to_end;
+	span[1].nr = count - span[0].nr;
+	span[0].ptr = circ_slot(cbuf, idx);
+	span[1].ptr = cbuf->buf.cpy_buf;
+}
+
+static inline size_t circ_span_bytes(const ac_circ_buf_t *cbuf,
+				     const ac_circ_buf_span_t *span)
+{
+	return (size_t)span->nr * cbuf->elem_sz;
+}
+
+/* The size of the buffers memory in bytes */
+static inline size_t circ_buf_len(const ac_circ_buf_t *cbuf)
 {
-	u32 end = cbuf->size - 1 - (cbuf->head / cbuf->elem_sz);
-	u32 n = (end + (cbuf->tail / cbuf->elem_sz)) & (cbuf->size - 1);
+	return (size_t)cbuf->size * cbuf->elem_sz;
+}
 
-	return n <= end ? n : end + 1;
+static void circ_reset(ac_circ_buf_t *cbuf)
+{
+	cbuf->head = cbuf->tail = 0;
+	cbuf->head_cache = cbuf->tail_cache = 0;
 }
 
 static bool is_pow2(u32 val)
@@ -76,6 +136,29 @@ static bool is_pow2(u32 val)
 	return !(val & (val - 1));
 }
 
+/* Allocate and set up a buffer, without any memory for the items */
+static ac_circ_buf_t *circ_buf_alloc(u32 size, u32 elem_sz)
+{
+	ac_circ_buf_t *cbuf;
+
+	cbuf = aligned_alloc(AC_CIRC_BUF_CACHELINE_SZ, sizeof(ac_circ_buf_t));
+	circ_reset(cbuf);
+	cbuf->size = size;
+	cbuf->flags = 0;
+	cbuf->pop_item = NULL;
+	cbuf->buf.cpy_buf = NULL;
+
+	if (elem_sz == 0) {
+		cbuf->elem_sz = sizeof(void *);
+		cbuf->type = PTR_BUF;
+	} else {
+		cbuf->elem_sz = elem_sz;
+		cbuf->type = CPY_BUF;
+	}
+
+	return cbuf;
+}
+
 /**
  * ac_circ_buf_new - create a new circular buffer
  *
@@ -95,21 +178,120 @@ ac_circ_buf_t *ac_circ_buf_new(u32 size, u32 elem_sz)
 	if (!is_pow2(size))
 		return NULL;
 
-	cbuf = malloc(sizeof(ac_circ_buf_t));
-	cbuf->head = cbuf->tail = 0;
-	cbuf->size = size;
+	cbuf = circ_buf_alloc(size, elem_sz);
+	cbuf->buf.cpy_buf = malloc(circ_buf_len(cbuf));
 
-	if (elem_sz == 0) {
-		cbuf->elem_sz = 1;
-		cbuf->type = PTR_BUF;
-		cbuf->buf.ptr_buf = malloc(size * sizeof(void *));
-	} else {
-		cbuf->elem_sz = elem_sz;
-		cbuf->type = CPY_BUF;
-		cbuf->buf.cpy_buf = malloc((size_t)size * elem_sz);
+	return cbuf;
+}
+
+/**
+ * ac_circ_buf_new_spsc - create a new single producer/consumer buffer
+ *
+ * @size: The required size of the buffer, must be a power of two
+ * @elem_sz: The size of the individual elements being placed into
+ *           the buffer. Set to 0 for the storing of pointers rather
+ *           than copying the data.
+ *
+ * The buffer can be pushed to by one thread while another pops from it,
+ * without any locking. The push functions must only be called from the
+ * producer and the pop functions from the consumer.
+ *
+ * With a copy buffer, ac_circ_buf_pop() copies the item out of the
+ * buffer (as the producer may reuse its slot straight away) and returns a
+ * pointer to that copy, which is valid until the next ac_circ_buf_pop().
+ *
+ * ac_circ_buf_foreach() and ac_circ_buf_reset() must not be called while
+ * either side is active.
+ *
+ * Returns:
+ *
+ * A pointer to a newly allocated buffer or NULL on failure
+ */
+ac_circ_buf_t *ac_circ_buf_new_spsc(u32 size, u32 elem_sz)
+{
+	ac_circ_buf_t *cbuf = ac_circ_buf_new(size, elem_sz);
+
+	if (!cbuf)
+		return NULL;
+
+	cbuf->flags |= CIRC_BUF_SPSC;
+	if (cbuf->type == CPY_BUF)
+		cbuf->pop_item = malloc(elem_sz);
+
+	return cbuf;
+}
+
+/**
+ * ac_circ_buf_new_mirrored - create a new circular buffer mapped twice
+ *
+ * @size: The required size of the buffer, must be a power of two
+ * @elem_sz: The size of the individual elements being placed into
+ *           the buffer. Set to 0 for the storing of pointers rather
+ *           than copying the data.
+ *
+ * The buffer's memory (@size * @elem_sz bytes, or @size pointers) must be
+ * a multiple of the page size. It is mapped a second time straight after
+ * itself, so the spans from ac_circ_buf_reserve() and ac_circ_buf_peek()
+ * are always a single span, handy for e.g parsing records from a byte
+ * stream without having to deal with them straddling the end of the
+ * buffer.
+ *
+ * Returns:
+ *
+ * A pointer to a newly allocated buffer or NULL on failure (errno will be
+ * set to EINVAL if the size isn't valid)
+ */
+ac_circ_buf_t *ac_circ_buf_new_mirrored(u32 size, u32 elem_sz)
+{
+	ac_circ_buf_t *cbuf;
+	size_t len;
+	char *map;
+	int fd;
+
+	if (size == 0 || !is_pow2(size)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cbuf = circ_buf_alloc(size, elem_sz);
+	cbuf->flags |= CIRC_BUF_MIRRORED;
+
+	len = circ_buf_len(cbuf);
+	if (len % sysconf(_SC_PAGESIZE) != 0) {
+		errno = EINVAL;
+		goto out_free;
+	}
+
+	fd = memfd_create("ac_circ_buf", MFD_CLOEXEC);
+	if (fd == -1)
+		goto out_free;
+	if (ftruncate(fd, len) == -1)
+		goto out_close;
+
+	/* Grab enough address space for both, then map the file over it */
+	map = mmap(NULL, len * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+		   0);
+	if (map == MAP_FAILED)
+		goto out_close;
+	if (mmap(map, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+		 0) == MAP_FAILED ||
+	    mmap(map + len, len, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(map, len * 2);
+		goto out_close;
 	}
+	close(fd);
+
+	cbuf->buf.cpy_buf = map;
 
 	return cbuf;
+
+out_close:
+	close(fd);
+out_free:
+	ac_circ_buf_destroy(cbuf);
+
+	return NULL;
 }
 
 /**
@@ -123,7 +305,89 @@ ac_circ_buf_t *ac_circ_buf_new(u32 size, u32 elem_sz)
  */
 u32 ac_circ_buf_count(const ac_circ_buf_t *cbuf)
 {
-	return circ_count(cbuf);
+	u64 tail = __atomic_load_n(&cbuf->tail, __ATOMIC_ACQUIRE);
+
+	return circ_count(__atomic_load_n(&cbuf->head, __ATOMIC_ACQUIRE), tail);
+}
+
+/**
+ * ac_circ_buf_reserve - reserve space in the buffer to write items to
+ *
+ * @cbuf: The circular buffer to work on
+ * @count: The number of items to make space for
+ * @span: An array of two spans, set to where in the buffer the items
+ *        should be written. The second span is only used (->nr > 0) when
+ *        the space wraps around to the start of the buffer
+ *
+ * The items are written in place and then made visible to the consumer
+ * with ac_circ_buf_commit(). For a buffer of pointers, the spans point to
+ * arrays of void *.
+ *
+ * Returns:
+ *
+ * 0 on success or -1 if there is no room for @count items
+ */
+int ac_circ_buf_reserve(ac_circ_buf_t *cbuf, u32 count,
+			ac_circ_buf_span_t *span)
+{
+	u64 head = cbuf->head;
+	u64 tail = cbuf->tail_cache;
+
+	if (circ_space(cbuf, head, tail) < count &&
+	    circ_space(cbuf, head, circ_prod_tail(cbuf)) < count)
+		return -1;
+
+	circ_spans(cbuf, head, count, span);
+
+	return 0;
+}
+
+/**
+ * ac_circ_buf_commit - make items written to reserved space visible
+ *
+ * @cbuf: The circular buffer to work on
+ * @count: The number of items written, no more than was reserved
+ */
+void ac_circ_buf_commit(ac_circ_buf_t *cbuf, u32 count)
+{
+	__atomic_store_n(&cbuf->head, cbuf->head + count, __ATOMIC_RELEASE);
+}
+
+/**
+ * ac_circ_buf_peek - get the items in the buffer without removing them
+ *
+ * @cbuf: The circular buffer to work on
+ * @span: An array of two spans, set to where in the buffer the items are.
+ *        The second span is only used (->nr > 0) when the items wrap
+ *        around to the start of the buffer
+ *
+ * The items can be read in place and then removed with
+ * ac_circ_buf_consume(). For a buffer of pointers, the spans point to
+ * arrays of void *.
+ *
+ * Returns:
+ *
+ * The number of items in the spans
+ */
+u32 ac_circ_buf_peek(ac_circ_buf_t *cbuf, ac_circ_buf_span_t *span)
+{
+	u64 tail = cbuf->tail;
+	u32 count = circ_count(circ_cons_head(cbuf), tail);
+
+	circ_spans(cbuf, tail, count, span);
+
+	return count;
+}
+
+/**
+ * ac_circ_buf_consume - remove items from the buffer after a peek
+ *
+ * @cbuf: The circular buffer to work on
+ * @count: The number of items to remove, no more than were peeked
+ */
+void ac_circ_buf_consume(ac_circ_buf_t *cbuf, u32 count)
+{
+	__atomic_store_n(&cbuf->tail, cbuf->tail + count, __ATOMIC_RELEASE);
 }
 
 /**
@@ -135,26 +399,23 @@ u32 ac_circ_buf_count(const ac_circ_buf_t *cbuf)
  *
  * Returns:
  *
- * 0 on success or -1 if there was no room (contiguous space)
+ * 0 on success or -1 if there was no room. The items are split across
+ * the end of the buffer as needed
  */
 int ac_circ_buf_pushm(ac_circ_buf_t *cbuf, const void *buf, u32 count)
 {
-	if (circ_space_to_end(cbuf) < count) {
-		if (circ_count(cbuf) == 0 && count <= cbuf->size)
-			cbuf->head = cbuf->tail = 0;
-		else
-			return -1;
-	}
+	ac_circ_buf_span_t span[2];
+	size_t len;
 
-	if (cbuf->type == PTR_BUF)
-		memcpy(cbuf->buf.ptr_buf + cbuf->head, buf,
-		       count * sizeof(void *));
-	else
-		memcpy(cbuf->buf.cpy_buf + cbuf->head, buf,
-		       (size_t)count * cbuf->elem_sz);
+	if (ac_circ_buf_reserve(cbuf, count, span) == -1)
+		return -1;
 
-	cbuf->head = (cbuf->head + (count * cbuf->elem_sz)) &
-		     ((cbuf->size - 1) * cbuf->elem_sz);
+	len = circ_span_bytes(cbuf, &span[0]);
+	memcpy(span[0].ptr, buf, len);
+	memcpy(span[1].ptr, (const char *)buf + len,
+	       circ_span_bytes(cbuf, &span[1]));
+
+	ac_circ_buf_commit(cbuf, count);
 
 	return 0;
 }
@@ -171,16 +432,19 @@ int ac_circ_buf_pushm(ac_circ_buf_t *cbuf, const void *buf, u32 count)
  */
 int ac_circ_buf_push(ac_circ_buf_t *cbuf, const void *buf)
 {
-	if (circ_space(cbuf) == 0)
+	u64 head = cbuf->head;
+	u64 tail = cbuf->tail_cache;
+
+	if (circ_space(cbuf, head, tail) == 0 &&
+	    circ_space(cbuf, head, circ_prod_tail(cbuf)) == 0)
 		return -1;
 
 	if (cbuf->type == PTR_BUF)
-		cbuf->buf.ptr_buf[cbuf->head] = (void *)buf;
+		*(const void **)circ_slot(cbuf, head) = buf;
 	else
-		memcpy(cbuf->buf.cpy_buf + cbuf->head, buf, cbuf->elem_sz);
+		memcpy(circ_slot(cbuf, head), buf, cbuf->elem_sz);
 
-	cbuf->head = (cbuf->head + cbuf->elem_sz) &
-		     ((cbuf->size - 1) * cbuf->elem_sz);
+	__atomic_store_n(&cbuf->head, head + 1, __ATOMIC_RELEASE);
 
 	return 0;
 }
@@ -194,22 +458,24 @@ int ac_circ_buf_push(ac_circ_buf_t *cbuf, const void *buf)
  * Returns:
  *
  * 0 on success and buf will contain the popped items or -1 if there
- * was not enough contiguous items to satisfy @count
+ * was not enough items to satisfy @count
  */
 int ac_circ_buf_popm(ac_circ_buf_t *cbuf, void *buf, u32 count)
 {
-	if (circ_count_to_end(cbuf) < count)
+	ac_circ_buf_span_t span[2];
+	size_t len;
+
+	if (ac_circ_buf_peek(cbuf, span) < count)
 		return -1;
 
-	if (cbuf->type == PTR_BUF)
-		memcpy(buf, cbuf->buf.ptr_buf + cbuf->tail,
-		       count * sizeof(void *));
-	else
-		memcpy(buf, cbuf->buf.cpy_buf + cbuf->tail,
-		       (size_t)count * cbuf->elem_sz);
+	/* Only take what was asked for */
+	circ_spans(cbuf, cbuf->tail, count, span);
+	len = circ_span_bytes(cbuf, &span[0]);
+	memcpy(buf, span[0].ptr, len);
+	memcpy((char *)buf + len, span[1].ptr,
+	       circ_span_bytes(cbuf, &span[1]));
 
-	cbuf->tail = (cbuf->tail + (count * cbuf->elem_sz)) &
-		     ((cbuf->size - 1) * cbuf->elem_sz);
+	ac_circ_buf_consume(cbuf, count);
 
 	return 0;
 }
@@ -225,18 +491,21 @@ int ac_circ_buf_popm(ac_circ_buf_t *cbuf, void *buf, u32 count)
  */
 void *ac_circ_buf_pop(ac_circ_buf_t *cbuf)
 {
+	u64 tail = cbuf->tail;
+	u64 head = cbuf->head_cache;
 	void *item;
 
-	if (circ_count(cbuf) == 0)
+	if (circ_count(head, tail) == 0 &&
+	    circ_count(circ_cons_head(cbuf), tail) == 0)
 		return NULL;
 
+	item = circ_slot(cbuf, tail);
 	if (cbuf->type == PTR_BUF)
-		item = cbuf->buf.ptr_buf[cbuf->tail];
-	else
-		item = cbuf->buf.cpy_buf + cbuf->tail;
+		item = *(void **)item;
+	else if (cbuf->pop_item)
+		item = memcpy(cbuf->pop_item, item, cbuf->elem_sz);
 
-	cbuf->tail = (cbuf->tail + cbuf->elem_sz) &
-		     ((cbuf->size - 1) * cbuf->elem_sz);
+	__atomic_store_n(&cbuf->tail, tail + 1, __ATOMIC_RELEASE);
 
 	return item;
 }
@@ -253,21 +522,15 @@ void ac_circ_buf_foreach(const ac_circ_buf_t *cbuf,
 			 void *user_data)
 {
 	u32 i;
-	u32 count = circ_count(cbuf);
-
-	if (count == 0)
-		return;
+	u32 count = circ_count(cbuf->head, cbuf->tail);
 
 	for (i = 0; i < count; i++) {
-		u32 k;
-
-		k = (cbuf->tail + (i * cbuf->elem_sz)) &
-		    ((cbuf->size - 1) * cbuf->elem_sz);
+		void *item = circ_slot(cbuf, cbuf->tail + i);
 
 		if (cbuf->type == PTR_BUF)
-			action(cbuf->buf.ptr_buf[k], user_data);
+			action(*(void **)item, user_data);
 		else
-			action(cbuf->buf.cpy_buf + k, user_data);
+			action(item, user_data);
 	}
 }
 
@@ -278,7 +541,7 @@ void ac_circ_buf_foreach(const ac_circ_buf_t *cbuf,
  */
 void ac_circ_buf_reset(ac_circ_buf_t *cbuf)
 {
-	cbuf->head = cbuf->tail = 0;
+	circ_reset(cbuf);
 }
 
 /**
@@ -288,9 +551,189 @@ void ac_circ_buf_reset(ac_circ_buf_t *cbuf)
  */
 void ac_circ_buf_destroy(const ac_circ_buf_t *cbuf)
 {
+	if (cbuf->flags & CIRC_BUF_MIRRORED) {
+		if (cbuf->buf.cpy_buf)
+			munmap(cbuf->buf.cpy_buf, circ_buf_len(cbuf) * 2);
+	} else {
+		free(cbuf->buf.cpy_buf);
+	}
+	free(cbuf->pop_item);
+	free((void *)cbuf);
+}
+
+static inline struct circ_mpmc_slot *circ_mpmc_slot(
+					const ac_circ_buf_mpmc_t *cbuf,
+					u64 pos)
+{
+	return (struct circ_mpmc_slot *)((char *)cbuf->slots +
+					 (size_t)(pos & (cbuf->size - 1)) *
+					 cbuf->slot_sz);
+}
+
+/**
+ * ac_circ_buf_mpmc_new - create a new multi producer/consumer buffer
+ *
+ * @size: The required size of the buffer, must be a power of two
+ * @elem_sz: The size of the individual elements being placed into
+ *           the buffer. Set to 0 for the storing of pointers rather
+ *           than copying the data.
+ *
+ * Any number of threads may push and pop concurrently without locking.
+ * Each slot has a sequence number saying whether it is ready to be pushed
+ * to or popped from, so a pusher/popper only contends with others on the
+ * position it claims with a compare-and-swap.
+ *
+ * Returns:
+ *
+ * A pointer to a newly allocated buffer or NULL on failure
+ */
+ac_circ_buf_mpmc_t *ac_circ_buf_mpmc_new(u32 size, u32 elem_sz)
+{
+	ac_circ_buf_mpmc_t *cbuf;
+	u32 i;
+
+	if (size == 0 || !is_pow2(size))
+		return NULL;
+
+	cbuf = aligned_alloc(AC_CIRC_BUF_CACHELINE_SZ,
+			     sizeof(ac_circ_buf_mpmc_t));
+	cbuf->size = size;
+	if (elem_sz == 0) {
+		cbuf->elem_sz = sizeof(void *);
+		cbuf->type = PTR_BUF;
+	} else {
+		cbuf->elem_sz = elem_sz;
+		cbuf->type = CPY_BUF;
+	}
+	/* Keep the sequence numbers aligned */
+	cbuf->slot_sz = (sizeof(struct circ_mpmc_slot) + cbuf->elem_sz +
+			 sizeof(u64) - 1) & ~(sizeof(u64) - 1);
+	cbuf->slots = malloc((size_t)size * cbuf->slot_sz);
+	for (i = 0; i < size; i++)
+		circ_mpmc_slot(cbuf, i)->seq = i;
+	cbuf->head = cbuf->tail = 0;
+
+	return cbuf;
+}
+
+/**
+ * ac_circ_buf_mpmc_push - push an item into the buffer
+ *
+ * @cbuf: The circular buffer to work on
+ * @buf: The item to add
+ *
+ * Returns:
+ *
+ * 0 on success or -1 if the buffer is full
+ */
+int ac_circ_buf_mpmc_push(ac_circ_buf_mpmc_t *cbuf, const void *buf)
+{
+	struct circ_mpmc_slot *slot;
+	u64 pos = __atomic_load_n(&cbuf->head, __ATOMIC_RELAXED);
+
+	for (;;) {
+		s64 diff;
+
+		slot = circ_mpmc_slot(cbuf, pos);
+		diff = (s64)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+			     pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&cbuf->head, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* The slot still holds the item from a lap ago */
+			return -1;
+		} else {
+			pos = __atomic_load_n(&cbuf->head, __ATOMIC_RELAXED);
+		}
+	}
+
 	if (cbuf->type == PTR_BUF)
-		free(cbuf->buf.ptr_buf);
+		memcpy(slot->data, &buf, sizeof(void *));
 	else
-		free(cbuf->buf.cpy_buf);
+		memcpy(slot->data, buf, cbuf->elem_sz);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * ac_circ_buf_mpmc_pop - pop an item from the buffer
+ *
+ * @cbuf: The circular buffer to work on
+ * @buf: Where to copy the item to, for a buffer of pointers this is
+ *       where to store the pointer (i.e a void **)
+ *
+ * Returns:
+ *
+ * 0 on success or -1 if the buffer is empty
+ */
+int ac_circ_buf_mpmc_pop(ac_circ_buf_mpmc_t *cbuf, void *buf)
+{
+	struct circ_mpmc_slot *slot;
+	u64 pos = __atomic_load_n(&cbuf->tail, __ATOMIC_RELAXED);
+
+	for (;;) {
+		s64 diff;
+
+		slot = circ_mpmc_slot(cbuf, pos);
+		diff = (s64)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+			     (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&cbuf->tail, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* Nothing has been pushed to this slot yet */
+			return -1;
+		} else {
+			pos = __atomic_load_n(&cbuf->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(buf, slot->data, cbuf->elem_sz);
+	__atomic_store_n(&slot->seq, pos + cbuf->size, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * ac_circ_buf_mpmc_count - how many items are in the buffer
+ *
+ * @cbuf: The circular buffer to work on
+ *
+ * With other threads pushing/popping this is only a snapshot.
+ *
+ * Returns:
+ *
+ * The number of items in the buffer
+ */
+u32 ac_circ_buf_mpmc_count(const ac_circ_buf_mpmc_t *cbuf)
+{
+	u64 tail = __atomic_load_n(&cbuf->tail, __ATOMIC_ACQUIRE);
+	u64 head = __atomic_load_n(&cbuf->head, __ATOMIC_ACQUIRE);
+
+	/* A pop may have claimed a position we didn't see pushed */
+	if (head < tail)
+		return 0;
+	if (head - tail > cbuf->size)
+		return cbuf->size;
+
+	return head - tail;
+}
+
+/**
+ * ac_circ_buf_mpmc_destroy - destroy a multi producer/consumer buffer
+ *
+ * @cbuf: The circular buffer to work on
+ */
+void ac_circ_buf_mpmc_destroy(const ac_circ_buf_mpmc_t *cbuf)
+{
+	free(cbuf->slots);
 	free((void *)cbuf);
 }
@@ -3,65 +3,570 @@
 /*
  * ac_htable.c - Hash Table
  *
+ * This is an open addressing hash table using Robin Hood hashing with
+ * backward shift deletion. The key/data pointers are stored inline in a
+ * single power of 2 sized array which grows and shrinks as needed.
+ *
+ * Resizing can optionally be done incrementally, a few slots of the old
+ * array being moved across to the new one on each operation, so that no
+ * single operation has to move the whole table.
+ *
  * Copyright (c) 2017, 2020	Andrew Clayton <andrew@digital-domain.net>
  */
 
 #define _GNU_SOURCE
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "include/libac.h"
 
-#define HTABLE_SZ	2048
+#define HTABLE_MIN_SZ		16
+#define HTABLE_MAX_SZ		(1U << 31)
+/* By default, grow when the table is more than 80% full */
+#define HTABLE_DEF_MAX_LOAD	0.8f
+/* Shrink when the table is less than 1/8th full */
+#define HTABLE_SHRINK_DEN	8
+
+/* 2^64 / phi, used for Fibonacci hashing */
+#define HTABLE_FIB_MUL		0x9E3779B97F4A7C15ULL
+/*
+ * Used to pick the shard in a concurrent hash table, different from the
+ * above so the shard and slot selection use independent bits.
+ */
+#define HTABLE_SHARD_MUL	0xC2B2AE3D27D4EB4FULL
+
+/* How many keys to hash and prefetch at a time for the _many() functions */
+#define HTABLE_BATCH_SZ		16
 
-struct bucket_list_elem {
+#define HTABLE_DEF_NR_SHARDS	64
+#define HTABLE_CACHELINE_SZ	64
+
+/*
+ * Lookup hit/miss counting is only built in with -DAC_HTABLE_STATS (make
+ * HTABLE_STATS=1). Lookups may be done concurrently under a read lock,
+ * hence the atomic.
+ */
+#ifdef AC_HTABLE_STATS
+#define HTABLE_STAT_INC(htable, stat) \
+	__atomic_add_fetch(&((ac_htable_t *)(htable))->stat, 1, \
+			   __ATOMIC_RELAXED)
+#else
+#define HTABLE_STAT_INC(htable, stat)	do { } while (0)
+#endif
+
+/*
+ * ->hash is the full value returned by ->hash_func() (or ->hash_func64()),
+ * it's checked before calling ->key_cmp() and is reused when the table is
+ * resized.
+ *
+ * ->dist is the distance (+1) of the entry from its home slot, 0 marks
+ * an empty slot.
+ */
+struct ac_htable_entry {
 	void *key;
 	void *data;
+	u64 hash;
+	u32 dist;
 };
 
-static ac_slist_t *bucket_list_lookup(const ac_htable_t *htable,
-				      ac_slist_t *list, const void *key)
+/*
+ * A concurrent hash table is made up of a number of ordinary hash tables
+ * (shards) each protected by its own lock. Each shard sits on its own
+ * cache line(s) so threads working on different shards don't contend.
+ */
+struct ac_htable_shard {
+	pthread_rwlock_t lock;
+	ac_htable_t htable;
+} __attribute__((aligned(HTABLE_CACHELINE_SZ)));
+
+/*
+ * Use the top bits of the multiplied hash for the slot index so that
+ * weak hash functions (e.g pointers with their low bits clear) still get
+ * a good spread.
+ */
+static inline u32 htable_slot(const ac_htable_t *htable, u64 hash)
+{
+	return (hash * HTABLE_FIB_MUL) >> htable->shift;
+}
+
+static inline u32 htable_old_slot(const ac_htable_t *htable, u64 hash)
+{
+	return (hash * HTABLE_FIB_MUL) >> htable->old_shift;
+}
+
+static void htable_set_size(ac_htable_t *htable, u32 size)
+{
+	htable->size = size;
+	htable->shift = 64 - __builtin_ctz(size);
+	htable->grow_at = (u64)((double)size * htable->max_load);
+	htable->shrink_at = size > htable->min_size ?
+			    size / HTABLE_SHRINK_DEN : 0;
+}
+
+/*
+ * Find the smallest table size that can hold nr_entries without
+ * exceeding max_load, 0 if it's too big.
+ */
+static u32 htable_size_for(u64 nr_entries, float max_load)
 {
-	while (list) {
-		const struct bucket_list_elem *elem = list->data;
-		bool again = htable->key_cmp(elem->key, key);
+	u64 size = HTABLE_MIN_SZ;
 
-		if (!again)
-			return list;
-		list = list->next;
+	while ((double)size * max_load < nr_entries) {
+		size <<= 1;
+		if (size > HTABLE_MAX_SZ)
+			return 0;
 	}
 
+	return size;
+}
+
+static void htable_setup(ac_htable_t *htable, u32 size, float max_load,
+			 u32 (*hash_func)(const void *key),
+			 int (*key_cmp)(const void *a, const void *b),
+			 void (*free_key_func)(void *key),
+			 void (*free_data_func)(void *data))
+{
+	htable->entries = calloc(size, sizeof(struct ac_htable_entry));
+	htable->hash_func = hash_func;
+	htable->hash_func64 = NULL;
+	htable->key_cmp = key_cmp;
+	htable->free_key_func = free_key_func;
+	htable->free_data_func = free_data_func;
+	htable->count = 0;
+	htable->gen = 0;
+	htable->nr_hits = 0;
+	htable->nr_misses = 0;
+	htable->old_entries = NULL;
+	htable->old_size = 0;
+	htable->rehash_idx = 0;
+	htable->rehash_step = 0;
+	htable->max_load = max_load;
+	htable->min_size = size;
+	htable_set_size(htable, size);
+}
+
+static ac_htable_t *htable_init(u32 size, float max_load,
+				u32 (*hash_func)(const void *key),
+				int (*key_cmp)(const void *a, const void *b),
+				void (*free_key_func)(void *key),
+				void (*free_data_func)(void *data))
+{
+	ac_htable_t *htable = malloc(sizeof(ac_htable_t));
+
+	htable_setup(htable, size, max_load, hash_func, key_cmp,
+		     free_key_func, free_data_func);
+
+	return htable;
+}
+
+static inline u64 htable_hash(const ac_htable_t *htable, const void *key)
+{
+	if (htable->hash_func64)
+		return htable->hash_func64(key);
+
+	return htable->hash_func(key);
+}
+
+static bool htable_probe(const ac_htable_t *htable,
+			 const struct ac_htable_entry *entries, u32 mask,
+			 u32 idx, const void *key, u64 hash, u32 *slot)
+{
+	u32 dist = 1;
+
+	for (;;) {
+		const struct ac_htable_entry *entry = &entries[idx];
+
+		/* Hit an empty slot or an entry closer to home than us */
+		if (entry->dist < dist)
+			return false;
+		if (entry->dist == dist && entry->hash == hash &&
+		    htable->key_cmp(entry->key, key) == 0)
+			break;
+
+		idx = (idx + 1) & mask;
+		dist++;
+	}
+
+	*slot = idx;
+
+	return true;
+}
+
+static bool htable_find(const ac_htable_t *htable, const void *key,
+			u64 hash, u32 *slot)
+{
+	return htable_probe(htable, htable->entries, htable->size - 1,
+			    htable_slot(htable, hash), key, hash, slot);
+}
+
+/*
+ * Look for key in the table and, if a resize is in progress, in the old
+ * table.
+ *
+ * Returns the array the entry was found in or NULL.
+ */
+static struct ac_htable_entry *htable_find_any(const ac_htable_t *htable,
+					       const void *key, u64 hash,
+					       u32 *slot)
+{
+	if (htable_find(htable, key, hash, slot))
+		return htable->entries;
+	if (htable->old_entries &&
+	    htable_probe(htable, htable->old_entries, htable->old_size - 1,
+			 htable_old_slot(htable, hash), key, hash, slot))
+		return htable->old_entries;
+
 	return NULL;
 }
 
-static bool bucket_list_remove(const ac_htable_t *htable, ac_slist_t **list,
-			       const void *key)
+static void htable_place(ac_htable_t *htable, void *key, void *data,
+			 u64 hash)
 {
-	ac_slist_t **pp = list;
-	ac_slist_t *p;
-	bool ret = false;
+	struct ac_htable_entry ins = { .key = key, .data = data,
+				       .hash = hash, .dist = 1 };
+	u32 mask = htable->size - 1;
+	u32 idx = htable_slot(htable, hash);
+
+	for (;;) {
+		struct ac_htable_entry *entry = &htable->entries[idx];
+
+		if (entry->dist == 0) {
+			*entry = ins;
+			return;
+		}
+
+		/* Take from the rich, give to the poor */
+		if (entry->dist < ins.dist) {
+			struct ac_htable_entry tmp = *entry;
 
-	while ((p = *pp) != NULL) {
-		struct bucket_list_elem *elem = p->data;
-		bool again = htable->key_cmp(elem->key, key);
+			*entry = ins;
+			ins = tmp;
+		}
 
-		if (!again) {
-			*pp = p->next;
+		idx = (idx + 1) & mask;
+		ins.dist++;
+	}
+}
 
-			if (htable->free_key_func)
-				htable->free_key_func(elem->key);
-			if (htable->free_data_func)
-				htable->free_data_func(elem->data);
-			free(elem);
-			free(p);
+/*
+ * Empty the slot by shifting any following entries that are not in their
+ * home slot back by one.
+ */
+static void htable_shift_back(struct ac_htable_entry *entries, u32 mask,
+			      u32 slot)
+{
+	for (;;) {
+		u32 next = (slot + 1) & mask;
 
-			ret = true;
+		if (entries[next].dist <= 1)
 			break;
+
+		entries[slot] = entries[next];
+		entries[slot].dist--;
+		slot = next;
+	}
+
+	entries[slot].dist = 0;
+}
+
+static void htable_free_entry(const ac_htable_t *htable,
+			      const struct ac_htable_entry *entry)
+{
+	if (htable->free_key_func)
+		htable->free_key_func(entry->key);
+	if (htable->free_data_func)
+		htable->free_data_func(entry->data);
+}
+
+/*
+ * Move up to nr_slots worth of the old table across to the new one, each
+ * entry moved and each empty slot skipped over counting as one.
+ *
+ * The old table is walked from the start. Moving the entry at rehash_idx
+ * shifts back any entries displaced from it, so we stay put until it's
+ * empty. Once it is, nothing after it can have a home slot before it, so
+ * lookups never need to look in the part of the old table already done.
+ */
+static void htable_rehash(ac_htable_t *htable, u32 nr_slots)
+{
+	struct ac_htable_entry *old = htable->old_entries;
+	u32 mask = htable->old_size - 1;
+
+	while (nr_slots-- > 0 && htable->rehash_idx < htable->old_size) {
+		const struct ac_htable_entry *entry = &old[htable->rehash_idx];
+
+		if (entry->dist == 0) {
+			htable->rehash_idx++;
+			continue;
 		}
-		pp = &p->next;
+
+		htable_place(htable, entry->key, entry->data, entry->hash);
+		htable_shift_back(old, mask, htable->rehash_idx);
+		if (entry->dist == 0)
+			htable->rehash_idx++;
 	}
 
-	return ret;
+	if (htable->rehash_idx < htable->old_size)
+		return;
+
+	free(old);
+	htable->old_entries = NULL;
+	htable->old_size = 0;
+}
+
+static void htable_rehash_finish(ac_htable_t *htable)
+{
+	while (htable->old_entries)
+		htable_rehash(htable, HTABLE_MAX_SZ);
+}
+
+static void htable_resize(ac_htable_t *htable, u32 size)
+{
+	struct ac_htable_entry *old;
+	u32 old_size;
+	u32 i;
+
+	/* Only one resize can be in progress at a time */
+	htable_rehash_finish(htable);
+
+	old = htable->entries;
+	old_size = htable->size;
+
+	htable->entries = calloc(size, sizeof(struct ac_htable_entry));
+	htable->gen++;
+
+	if (htable->rehash_step) {
+		htable->old_entries = old;
+		htable->old_size = old_size;
+		htable->old_shift = htable->shift;
+		htable->rehash_idx = 0;
+		htable_set_size(htable, size);
+
+		return;
+	}
+
+	htable_set_size(htable, size);
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].dist == 0)
+			continue;
+		htable_place(htable, old[i].key, old[i].data, old[i].hash);
+	}
+
+	free(old);
+}
+
+static void htable_erase(ac_htable_t *htable, u32 slot)
+{
+	htable_free_entry(htable, &htable->entries[slot]);
+	htable_shift_back(htable->entries, htable->size - 1, slot);
+	htable->count--;
+}
+
+static void htable_insert(ac_htable_t *htable, void *key, void *data,
+			  u64 hash)
+{
+	struct ac_htable_entry *entries;
+	u32 slot;
+
+	if (htable->old_entries)
+		htable_rehash(htable, htable->rehash_step);
+
+	entries = htable_find_any(htable, key, hash, &slot);
+	if (entries) {
+		struct ac_htable_entry *entry = &entries[slot];
+
+		htable_free_entry(htable, entry);
+		entry->key = key;
+		entry->data = data;
+
+		return;
+	}
+
+	/*
+	 * At the maximum size, carry on filling it past max_load, but always
+	 * leave one slot empty, iteration and shifting back rely on it.
+	 */
+	if (htable->count + 1 > htable->grow_at) {
+		if (htable->size < HTABLE_MAX_SZ) {
+			htable_resize(htable, htable->size * 2);
+		} else if (htable->count + 1 >= htable->size) {
+			errno = ENOSPC;
+			return;
+		}
+	}
+
+	htable_place(htable, key, data, hash);
+	htable->count++;
+}
+
+static bool htable_remove(ac_htable_t *htable, const void *key, u64 hash)
+{
+	struct ac_htable_entry *entries;
+	u32 slot;
+
+	if (htable->old_entries)
+		htable_rehash(htable, htable->rehash_step);
+
+	entries = htable_find_any(htable, key, hash, &slot);
+	if (!entries)
+		return false;
+
+	if (entries == htable->entries) {
+		htable_erase(htable, slot);
+	} else {
+		htable_free_entry(htable, &entries[slot]);
+		htable_shift_back(entries, htable->old_size - 1, slot);
+		htable->count--;
+	}
+	if (htable->count < htable->shrink_at)
+		htable_resize(htable, htable->size / 2);
+
+	return true;
+}
+
+static void *htable_lookup(const ac_htable_t *htable, const void *key,
+			   u64 hash)
+{
+	const struct ac_htable_entry *entries;
+	u32 slot;
+
+	entries = htable_find_any(htable, key, hash, &slot);
+	if (!entries) {
+		HTABLE_STAT_INC(htable, nr_misses);
+		return NULL;
+	}
+
+	HTABLE_STAT_INC(htable, nr_hits);
+
+	return entries[slot].data;
+}
+
+/* Accumulate the stats for a table, see ac_htable_stats() */
+static void htable_stats_add_entries(const struct ac_htable_entry *entries,
+				     u32 size, ac_htable_stats_t *stats,
+				     u64 *total_dist)
+{
+	u32 i;
+
+	for (i = 0; i < size; i++) {
+		u32 dist = entries[i].dist;
+
+		if (dist == 0)
+			continue;
+		*total_dist += dist;
+		if (dist > stats->max_probe)
+			stats->max_probe = dist;
+	}
+}
+
+/*
+ * struct_sz is the size of what the table is embedded in, e.g a shard
+ * with its lock for the concurrent hash table.
+ */
+static void htable_stats_add(const ac_htable_t *htable, size_t struct_sz,
+			     ac_htable_stats_t *stats, u64 *total_dist)
+{
+	stats->bytes += struct_sz +
+			((size_t)htable->size + htable->old_size) *
+			sizeof(struct ac_htable_entry);
+	stats->count += htable->count;
+	stats->size += htable->size;
+	stats->nr_hits += htable->nr_hits;
+	stats->nr_misses += htable->nr_misses;
+
+	htable_stats_add_entries(htable->entries, htable->size, stats,
+				 total_dist);
+	if (htable->old_entries)
+		htable_stats_add_entries(htable->old_entries,
+					 htable->old_size, stats, total_dist);
+}
+
+static void htable_stats_finish(ac_htable_stats_t *stats, u64 total_dist)
+{
+	stats->load = stats->size ? (double)stats->count / stats->size : 0.0;
+	stats->avg_probe = stats->count ?
+			   (double)total_dist / stats->count : 0.0;
+}
+
+static void htable_foreach_entries(const struct ac_htable_entry *entries,
+				   u32 size,
+				   void (*action)(void *key, void *value,
+						  void *user_data),
+				   void *user_data)
+{
+	u32 i;
+
+	for (i = 0; i < size; i++) {
+		const struct ac_htable_entry *entry = &entries[i];
+
+		if (entry->dist == 0)
+			continue;
+		action(entry->key, entry->data, user_data);
+	}
+}
+
+static void htable_foreach(const ac_htable_t *htable,
+			   void (*action)(void *key, void *value,
+					  void *user_data),
+			   void *user_data)
+{
+	htable_foreach_entries(htable->entries, htable->size, action,
+			       user_data);
+	if (htable->old_entries)
+		htable_foreach_entries(htable->old_entries, htable->old_size,
+				       action, user_data);
+}
+
+static void htable_free_array(const ac_htable_t *htable,
+			      struct ac_htable_entry *entries, u32 size)
+{
+	u32 i;
+
+	for (i = 0; i < size; i++) {
+		if (entries[i].dist == 0)
+			continue;
+		htable_free_entry(htable, &entries[i]);
+	}
+
+	free(entries);
+}
+
+static void htable_free_entries(const ac_htable_t *htable)
+{
+	htable_free_array(htable, htable->entries, htable->size);
+	if (htable->old_entries)
+		htable_free_array(htable, htable->old_entries,
+				  htable->old_size);
+}
+
+static ac_htable_t *htable_new_sized(u64 nr_entries, float max_load,
+				     u32 (*hash_func)(const void *key),
+				     int (*key_cmp)(const void *a,
+						    const void *b),
+				     void (*free_key_func)(void *key),
+				     void (*free_data_func)(void *data))
+{
+	u32 size;
+
+	if (max_load == 0.0f)
+		max_load = HTABLE_DEF_MAX_LOAD;
+	if (!(max_load > 0.0f && max_load < 1.0f))
+		goto out_einval;
+
+	size = htable_size_for(nr_entries, max_load);
+	if (!size)
+		goto out_einval;
+
+	return htable_init(size, max_load, hash_func, key_cmp,
+			   free_key_func, free_data_func);
+
+out_einval:
+	errno = EINVAL;
+	return NULL;
 }
 
 /**
@@ -72,6 +577,9 @@ static bool bucket_list_remove(const ac_htable_t *htable, ac_slist_t **list,
  * @free_key_func: Optional pointer to a key free'ing function
  * @free_data_func: Optional pointer to a data free'ing function
  *
+ * The table starts small and grows (and shrinks) automatically as entries
+ * are added and removed.
+ *
  * Returns:
  *
  * A pointer to a newly created hash table. Should be free'd with
@@ -81,20 +589,167 @@ ac_htable_t *ac_htable_new(u32 (*hash_func)(const void *key),
 			   int (*key_cmp)(const void *a, const void *b),
 			   void (*free_key_func)(void *key),
 			   void (*free_data_func)(void *data))
+{
+	return htable_init(HTABLE_MIN_SZ, HTABLE_DEF_MAX_LOAD, hash_func,
+			   key_cmp, free_key_func, free_data_func);
+}
+
+/**
+ * ac_htable_new64 - create a new hash table using a 64-bit hash function
+ *
+ * @hash_func: Pointer to a 64-bit hashing function
+ * @key_cmp: Pointer to a key comparison function
+ * @free_key_func: Optional pointer to a key free'ing function
+ * @free_data_func: Optional pointer to a data free'ing function
+ *
+ * As ac_htable_new(), but all 64 bits of the hash are used for both
+ * picking the slot and for checking against before calling @key_cmp.
+ *
+ * Returns:
+ *
+ * A pointer to a newly created hash table. Should be free'd with
+ * ac_htable_destroy()
+ */
+ac_htable_t *ac_htable_new64(u64 (*hash_func)(const void *key),
+			     int (*key_cmp)(const void *a, const void *b),
+			     void (*free_key_func)(void *key),
+			     void (*free_data_func)(void *data))
 {
 	ac_htable_t *htable;
 
-	htable = malloc(sizeof(ac_htable_t));
-	htable->buckets = calloc(HTABLE_SZ, sizeof(ac_slist_t *));
-	htable->hash_func = hash_func;
-	htable->key_cmp = key_cmp;
-	htable->free_key_func = free_key_func;
-	htable->free_data_func = free_data_func;
-	htable->count = 0;
+	htable = htable_init(HTABLE_MIN_SZ, HTABLE_DEF_MAX_LOAD, NULL,
+			     key_cmp, free_key_func, free_data_func);
+	htable->hash_func64 = hash_func;
 
 	return htable;
 }
 
+/**
+ * ac_htable_new_sized - create a new hash table sized for a number of entries
+ *
+ * @nr_entries: The number of entries expected to be stored
+ * @max_load: The maximum load factor (0.0 < max_load < 1.0) before the
+ *            table is grown. Pass 0 for the default (0.8)
+ * @hash_func: Pointer to a hashing function
+ * @key_cmp: Pointer to a key comparison function
+ * @free_key_func: Optional pointer to a key free'ing function
+ * @free_data_func: Optional pointer to a data free'ing function
+ *
+ * The table is created big enough that @nr_entries can be inserted without
+ * it needing to grow and it will not shrink below this size.
+ *
+ * Returns:
+ *
+ * A pointer to a newly created hash table or NULL on error (errno will be
+ * set to EINVAL). Should be free'd with ac_htable_destroy()
+ */
+ac_htable_t *ac_htable_new_sized(u64 nr_entries, float max_load,
+				 u32 (*hash_func)(const void *key),
+				 int (*key_cmp)(const void *a, const void *b),
+				 void (*free_key_func)(void *key),
+				 void (*free_data_func)(void *data))
+{
+	return htable_new_sized(nr_entries, max_load, hash_func, key_cmp,
+				free_key_func, free_data_func);
+}
+
+/**
+ * ac_htable_new64_sized - create a new pre-sized hash table using a 64-bit
+ *                         hash function
+ *
+ * @nr_entries: The number of entries expected to be stored
+ * @max_load: The maximum load factor (0.0 < max_load < 1.0) before the
+ *            table is grown. Pass 0 for the default (0.8)
+ * @hash_func: Pointer to a 64-bit hashing function
+ * @key_cmp: Pointer to a key comparison function
+ * @free_key_func: Optional pointer to a key free'ing function
+ * @free_data_func: Optional pointer to a data free'ing function
+ *
+ * See ac_htable_new_sized() & ac_htable_new64()
+ *
+ * Returns:
+ *
+ * A pointer to a newly created hash table or NULL on error (errno will be
+ * set to EINVAL). Should be free'd with ac_htable_destroy()
+ */
+ac_htable_t *ac_htable_new64_sized(u64 nr_entries, float max_load,
+				   u64 (*hash_func)(const void *key),
+				   int (*key_cmp)(const void *a, const void *b),
+				   void (*free_key_func)(void *key),
+				   void (*free_data_func)(void *data))
+{
+	ac_htable_t *htable;
+
+	htable = htable_new_sized(nr_entries, max_load, NULL, key_cmp,
+				  free_key_func, free_data_func);
+	if (htable)
+		htable->hash_func64 = hash_func;
+
+	return htable;
+}
+
+/**
+ * ac_htable_reserve - make room in a hash table for a number of entries
+ *
+ * @htable: The hash table to work on
+ * @nr_entries: The total number of entries the table should be able to hold
+ *
+ * After this call @nr_entries can be stored in the table without it needing
+ * to grow and the table will not shrink below this size.
+ *
+ * Returns:
+ *
+ * 0 on success or -1 on error (errno will be set to EINVAL)
+ */
+int ac_htable_reserve(ac_htable_t *htable, u64 nr_entries)
+{
+	u32 size = htable_size_for(nr_entries, htable->max_load);
+
+	if (!size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (size > htable->min_size)
+		htable->min_size = size;
+	if (size > htable->size)
+		htable_resize(htable, size);
+	else
+		htable_set_size(htable, htable->size);
+
+	return 0;
+}
+
+/**
+ * ac_htable_set_rehash_step - turn on/off incremental resizing of a table
+ *
+ * @htable: The hash table to work on
+ * @nr_slots: The number of slots to move across to the new table on each
+ *            insert or remove while a resize is in progress.
+ *            0 turns incremental resizing off (the default)
+ *
+ * Normally when a table needs to grow or shrink, every entry is moved into
+ * the new table there and then, which for a large table can take a while.
+ *
+ * With incremental resizing, the old table is kept around and a bounded
+ * amount of it is moved across on each subsequent operation until it is
+ * empty, entries being looked for in both tables in the mean time.
+ * Lookups only read the table, they don't move anything across.
+ *
+ * If another resize is needed before the current one has finished, or
+ * iteration is started with ac_htable_iter_init(), it is finished first.
+ * With the default maximum load, a @nr_slots of at least 2 ensures growing
+ * the table never has to do that.
+ *
+ * Turning incremental resizing off finishes any resize in progress.
+ */
+void ac_htable_set_rehash_step(ac_htable_t *htable, u32 nr_slots)
+{
+	htable->rehash_step = nr_slots;
+	if (!nr_slots)
+		htable_rehash_finish(htable);
+}
+
 /**
  * ac_htable_insert - inserts a new entry into a hash table
  *
@@ -103,25 +758,56 @@ ac_htable_t *ac_htable_new(u32 (*hash_func)(const void *key),
  * @data: The data to sore
  *
  * If you try and insert with an already existing key, the old entry will
- * be removed/free'd first
+ * be removed/free'd first.
+ *
+ * Once the table has reached its maximum size (2^31 slots) it stops
+ * growing and fills beyond its maximum load. Once only one free slot is
+ * left, the entry is not inserted and errno is set to ENOSPC.
  */
 void ac_htable_insert(ac_htable_t *htable, void *key, void *data)
 {
-	struct bucket_list_elem *ble = malloc(sizeof(struct bucket_list_elem));
-	u32 bucket = htable->hash_func(key) % HTABLE_SZ;
-	ac_slist_t *item;
+	htable_insert(htable, key, data, htable_hash(htable, key));
+}
+
+/**
+ * ac_htable_insert_many - inserts a number of entries into a hash table
+ *
+ * @htable: The hash table to insert into
+ * @keys: An array of @nr keys
+ * @data: An array of @nr data items, matching @keys
+ * @nr: The number of entries to insert
+ *
+ * This is the same as calling ac_htable_insert() for each entry, but the
+ * table is grown at most once up front and the keys are hashed in batches
+ * with their slots prefetched ahead of being used.
+ */
+void ac_htable_insert_many(ac_htable_t *htable, void * const *keys,
+			   void * const *data, size_t nr)
+{
+	size_t i;
 
-	ble->key = key;
-	ble->data = data;
+	if (htable->count + nr > htable->grow_at) {
+		u32 size = htable_size_for(htable->count + nr,
+					   htable->max_load);
 
-	item = bucket_list_lookup(htable, htable->buckets[bucket], key);
-	if (item) {
-		bucket_list_remove(htable, &htable->buckets[bucket], key);
-		htable->count--;
+		if (size > htable->size)
+			htable_resize(htable, size);
 	}
 
-	ac_slist_preadd(&htable->buckets[bucket], ble);
-	htable->count++;
+	for (i = 0; i < nr; i += HTABLE_BATCH_SZ) {
+		u64 hashes[HTABLE_BATCH_SZ];
+		size_t n = AC_MIN(nr - i, (size_t)HTABLE_BATCH_SZ);
+		size_t j;
+
+		for (j = 0; j < n; j++) {
+			hashes[j] = htable_hash(htable, keys[i + j]);
+			__builtin_prefetch(&htable->entries[
+					htable_slot(htable, hashes[j])], 1);
+		}
+		for (j = 0; j < n; j++)
+			htable_insert(htable, keys[i + j], data[i + j],
+				      hashes[j]);
+	}
 }
 
 /**
@@ -136,14 +822,7 @@ void ac_htable_insert(ac_htable_t *htable, void *key, void *data)
  */
 bool ac_htable_remove(ac_htable_t *htable, const void *key)
 {
-	u32 bucket = htable->hash_func(key) % HTABLE_SZ;
-	bool ret;
-
-	ret = bucket_list_remove(htable, &htable->buckets[bucket], key);
-	if (ret)
-		htable->count--;
-
-	return ret;
+	return htable_remove(htable, key, htable_hash(htable, key));
 }
 
 /**
@@ -158,14 +837,41 @@ bool ac_htable_remove(ac_htable_t *htable, const void *key)
  */
 void *ac_htable_lookup(const ac_htable_t *htable, const void *key)
 {
-	u32 bucket = htable->hash_func(key) % HTABLE_SZ;
-	ac_slist_t *item = bucket_list_lookup(htable, htable->buckets[bucket],
-					      key);
+	return htable_lookup(htable, key, htable_hash(htable, key));
+}
 
-	if (!item)
-		return NULL;
+/**
+ * ac_htable_lookup_many - lookup a number of entries in a hash table
+ *
+ * @htable: The hash table to lookup from
+ * @keys: An array of @nr keys to lookup
+ * @data: An array of @nr pointers to be filled in with the entries data,
+ *        or NULL for those not found
+ * @nr: The number of keys to lookup
+ *
+ * The keys are hashed in batches and their slots prefetched before being
+ * probed, so the cache misses for the batch overlap rather than being
+ * taken one after the other.
+ */
+void ac_htable_lookup_many(const ac_htable_t *htable, const void * const *keys,
+			   void **data, size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i += HTABLE_BATCH_SZ) {
+		u64 hashes[HTABLE_BATCH_SZ];
+		size_t n = AC_MIN(nr - i, (size_t)HTABLE_BATCH_SZ);
+		size_t j;
 
-	return ((struct bucket_list_elem *)item->data)->data;
+		for (j = 0; j < n; j++) {
+			hashes[j] = htable_hash(htable, keys[i + j]);
+			__builtin_prefetch(&htable->entries[
+					htable_slot(htable, hashes[j])], 0);
+		}
+		for (j = 0; j < n; j++)
+			data[i + j] = htable_lookup(htable, keys[i + j],
+						    hashes[j]);
+	}
 }
 
 /**
@@ -180,18 +886,135 @@ void ac_htable_foreach(const ac_htable_t *htable,
 		       void (*action)(void *key, void *value, void *user_data),
 		       void *user_data)
 {
-	u32 bucket;
+	htable_foreach(htable, action, user_data);
+}
+
+/**
+ * ac_htable_stats - get statistics about a hash table
+ *
+ * @htable: The hash table to get the statistics for
+ * @stats: Filled in with the statistics
+ *
+ * ->bytes is the memory used by the table itself (not the keys/data),
+ * ->size is the number of slots and ->load the fraction of them in use.
+ *
+ * ->max_probe is the largest and ->avg_probe the average number of slots
+ * looked at to find an entry, 1 being in its home slot.
+ *
+ * ->nr_hits & ->nr_misses count lookups, but only if the library was
+ * built with HTABLE_STATS=1, otherwise they are 0.
+ *
+ * This walks the whole table.
+ */
+void ac_htable_stats(const ac_htable_t *htable, ac_htable_stats_t *stats)
+{
+	u64 total_dist = 0;
 
-	for (bucket = 0; bucket < HTABLE_SZ; bucket++) {
-		ac_slist_t *list = htable->buckets[bucket];
+	memset(stats, 0, sizeof(ac_htable_stats_t));
+	htable_stats_add(htable, sizeof(ac_htable_t), stats, &total_dist);
+	htable_stats_finish(stats, total_dist);
+}
 
-		while (list) {
-			struct bucket_list_elem *elem = list->data;
+/**
+ * ac_htable_iter_init - initialise an iterator over a hash table
+ *
+ * @iter: The iterator to initialise
+ * @htable: The hash table to iterate over
+ *
+ * Entries can be removed while iterating with ac_htable_iter_remove().
+ *
+ * Any incremental resize in progress is finished first.
+ *
+ * The iterator can be kept and resumed later. If the table has been
+ * modified other than through ac_htable_iter_remove() in the mean time,
+ * entries may be missed or seen twice and if the table has been resized,
+ * the iteration ends.
+ */
+void ac_htable_iter_init(ac_htable_iter_t *iter, ac_htable_t *htable)
+{
+	u32 start = 0;
 
-			action(elem->key, elem->data, user_data);
-			list = list->next;
-		}
+	htable_rehash_finish(htable);
+
+	/*
+	 * Start from an empty slot (there is always at least one). Removing
+	 * an entry only ever shifts entries back towards it, so we never
+	 * see an entry twice or miss one.
+	 */
+	while (htable->entries[start].dist != 0)
+		start++;
+
+	iter->htable = htable;
+	iter->gen = htable->gen;
+	iter->start = start;
+	iter->offset = 1;
+	iter->slot = 0;
+	iter->can_remove = false;
+}
+
+/**
+ * ac_htable_iter_next - get the next entry from a hash table iterator
+ *
+ * @iter: The iterator to work on
+ * @key: Optional pointer to be set to the entries key
+ * @data: Optional pointer to be set to the entries data
+ *
+ * Returns:
+ *
+ * true if an entry was returned, false if the iteration has finished
+ */
+bool ac_htable_iter_next(ac_htable_iter_t *iter, void **key, void **data)
+{
+	const ac_htable_t *htable = iter->htable;
+	u32 mask = htable->size - 1;
+
+	iter->can_remove = false;
+	if (iter->gen != htable->gen)
+		return false;
+
+	while (iter->offset < htable->size) {
+		u32 slot = (iter->start + iter->offset++) & mask;
+		const struct ac_htable_entry *entry = &htable->entries[slot];
+
+		if (entry->dist == 0)
+			continue;
+
+		if (key)
+			*key = entry->key;
+		if (data)
+			*data = entry->data;
+		iter->slot = slot;
+		iter->can_remove = true;
+
+		return true;
 	}
+
+	return false;
+}
+
+/**
+ * ac_htable_iter_remove - remove the current entry from a hash table
+ *
+ * @iter: The iterator to work on
+ *
+ * Removes (and free's) the entry last returned by ac_htable_iter_next().
+ * The table is not shrunk while iterating.
+ *
+ * Returns:
+ *
+ * true if the entry was removed, false if there was no current entry
+ */
+bool ac_htable_iter_remove(ac_htable_iter_t *iter)
+{
+	if (!iter->can_remove || iter->gen != iter->htable->gen)
+		return false;
+
+	htable_erase(iter->htable, iter->slot);
+	/* The next entry may have been shifted back into this slot */
+	iter->offset--;
+	iter->can_remove = false;
+
+	return true;
 }
 
 /**
@@ -201,25 +1024,245 @@ void ac_htable_foreach(const ac_htable_t *htable,
  */
 void ac_htable_destroy(const ac_htable_t *htable)
 {
-	u32 bucket;
+	htable_free_entries(htable);
+	free((void *)htable);
+}
 
-	for (bucket = 0; bucket < HTABLE_SZ; bucket++) {
-		ac_slist_t *list = htable->buckets[bucket];
+static inline struct ac_htable_shard *htable_shard(
+					const ac_htable_concurrent_t *chtable,
+					u32 hash)
+{
+	u32 shard = (((u64)hash * HTABLE_SHARD_MUL) >> 32) &
+		    (chtable->nr_shards - 1);
 
-		while (list) {
-			struct bucket_list_elem *elem = list->data;
-			ac_slist_t *p = list->next;
+	return &chtable->shards[shard];
+}
 
-			if (htable->free_key_func)
-				htable->free_key_func(elem->key);
-			if (htable->free_data_func)
-				htable->free_data_func(elem->data);
-			free(elem);
-			free(list);
-			list = p;
-		}
+/**
+ * ac_htable_concurrent_new - create a new thread safe hash table
+ *
+ * @nr_shards: The number of shards to split the table into, must be a
+ *             power of 2. Pass 0 for the default (64)
+ * @hash_func: Pointer to a hashing function
+ * @key_cmp: Pointer to a key comparison function
+ * @free_key_func: Optional pointer to a key free'ing function
+ * @free_data_func: Optional pointer to a data free'ing function
+ *
+ * The table is split into a number of independently locked shards so that
+ * threads operating on different keys rarely contend with each other.
+ *
+ * Returns:
+ *
+ * A pointer to a newly created hash table or NULL on error (errno will be
+ * set to EINVAL). Should be free'd with ac_htable_concurrent_destroy()
+ */
+ac_htable_concurrent_t *ac_htable_concurrent_new(
+				u32 nr_shards,
+				u32 (*hash_func)(const void *key),
+				int (*key_cmp)(const void *a, const void *b),
+				void (*free_key_func)(void *key),
+				void (*free_data_func)(void *data))
+{
+	ac_htable_concurrent_t *chtable;
+	u32 i;
+
+	if (nr_shards == 0)
+		nr_shards = HTABLE_DEF_NR_SHARDS;
+	if (nr_shards & (nr_shards - 1)) {
+		errno = EINVAL;
+		return NULL;
 	}
 
-	free(htable->buckets);
-	free((void *)htable);
+	chtable = malloc(sizeof(ac_htable_concurrent_t));
+	chtable->shards = aligned_alloc(HTABLE_CACHELINE_SZ,
+					nr_shards *
+					sizeof(struct ac_htable_shard));
+	chtable->nr_shards = nr_shards;
+	chtable->hash_func = hash_func;
+
+	for (i = 0; i < nr_shards; i++) {
+		struct ac_htable_shard *shard = &chtable->shards[i];
+
+		pthread_rwlock_init(&shard->lock, NULL);
+		htable_setup(&shard->htable, HTABLE_MIN_SZ,
+			     HTABLE_DEF_MAX_LOAD, hash_func, key_cmp,
+			     free_key_func, free_data_func);
+	}
+
+	return chtable;
+}
+
+/**
+ * ac_htable_concurrent_insert - inserts a new entry into a hash table
+ *
+ * @chtable: The hash table to insert into
+ * @key: The key to use
+ * @data: The data to store
+ *
+ * If you try and insert with an already existing key, the old entry will
+ * be removed/free'd first
+ */
+void ac_htable_concurrent_insert(ac_htable_concurrent_t *chtable, void *key,
+				 void *data)
+{
+	u32 hash = chtable->hash_func(key);
+	struct ac_htable_shard *shard = htable_shard(chtable, hash);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	htable_insert(&shard->htable, key, data, hash);
+	pthread_rwlock_unlock(&shard->lock);
+}
+
+/**
+ * ac_htable_concurrent_remove - remove an entry from a hash table
+ *
+ * @chtable: The hash table to remove from
+ * @key: The key to use
+ *
+ * Returns:
+ *
+ * true if the entry was removed, false otherwise
+ */
+bool ac_htable_concurrent_remove(ac_htable_concurrent_t *chtable,
+				 const void *key)
+{
+	u32 hash = chtable->hash_func(key);
+	struct ac_htable_shard *shard = htable_shard(chtable, hash);
+	bool ret;
+
+	pthread_rwlock_wrlock(&shard->lock);
+	ret = htable_remove(&shard->htable, key, hash);
+	pthread_rwlock_unlock(&shard->lock);
+
+	return ret;
+}
+
+/**
+ * ac_htable_concurrent_lookup - lookup an entry in a hash table
+ *
+ * @chtable: The hash table to lookup from
+ * @key: The key to use
+ *
+ * If the table has a free_data_func, it is up to the caller to ensure the
+ * entry isn't removed (or replaced) by another thread while the returned
+ * data is still in use.
+ *
+ * Returns:
+ *
+ * A pointer to the entries data if found, NULL if not
+ */
+void *ac_htable_concurrent_lookup(const ac_htable_concurrent_t *chtable,
+				  const void *key)
+{
+	u32 hash = chtable->hash_func(key);
+	struct ac_htable_shard *shard = htable_shard(chtable, hash);
+	void *data;
+
+	pthread_rwlock_rdlock(&shard->lock);
+	data = htable_lookup(&shard->htable, key, hash);
+	pthread_rwlock_unlock(&shard->lock);
+
+	return data;
+}
+
+/**
+ * ac_htable_concurrent_foreach - iterate over each entry in a hash table
+ *
+ * @chtable: The hash table to iterate over
+ * @action: A pointer to a function to call for each entry. This will get the
+ *          key, data and optional user supplied data as arguments
+ * @user_data: Optional pointer to data to pass to the above function
+ *
+ * Each shard is read locked in turn while its entries are visited, so
+ * @action must not try to modify the table.
+ */
+void ac_htable_concurrent_foreach(const ac_htable_concurrent_t *chtable,
+				  void (*action)(void *key, void *value,
+						 void *user_data),
+				  void *user_data)
+{
+	u32 i;
+
+	for (i = 0; i < chtable->nr_shards; i++) {
+		struct ac_htable_shard *shard = &chtable->shards[i];
+
+		pthread_rwlock_rdlock(&shard->lock);
+		htable_foreach(&shard->htable, action, user_data);
+		pthread_rwlock_unlock(&shard->lock);
+	}
+}
+
+/**
+ * ac_htable_concurrent_count - get the number of entries in a hash table
+ *
+ * @chtable: The hash table to work on
+ *
+ * Returns:
+ *
+ * The number of entries in the table. If other threads are modifying the
+ * table this is only a snapshot
+ */
+unsigned long ac_htable_concurrent_count(const ac_htable_concurrent_t *chtable)
+{
+	unsigned long count = 0;
+	u32 i;
+
+	for (i = 0; i < chtable->nr_shards; i++) {
+		struct ac_htable_shard *shard = &chtable->shards[i];
+
+		pthread_rwlock_rdlock(&shard->lock);
+		count += shard->htable.count;
+		pthread_rwlock_unlock(&shard->lock);
+	}
+
+	return count;
+}
+
+/**
+ * ac_htable_concurrent_stats - get statistics about a hash table
+ *
+ * @chtable: The hash table to get the statistics for
+ * @stats: Filled in with the statistics summed over all the shards
+ *
+ * See ac_htable_stats()
+ */
+void ac_htable_concurrent_stats(const ac_htable_concurrent_t *chtable,
+				ac_htable_stats_t *stats)
+{
+	u64 total_dist = 0;
+	u32 i;
+
+	memset(stats, 0, sizeof(ac_htable_stats_t));
+	for (i = 0; i < chtable->nr_shards; i++) {
+		struct ac_htable_shard *shard = &chtable->shards[i];
+
+		pthread_rwlock_rdlock(&shard->lock);
+		htable_stats_add(&shard->htable, sizeof(struct ac_htable_shard),
+				 stats, &total_dist);
+		pthread_rwlock_unlock(&shard->lock);
+	}
+	stats->bytes += sizeof(ac_htable_concurrent_t);
+	htable_stats_finish(stats, total_dist);
+}
+
+/**
+ * ac_htable_concurrent_destroy - destroy the given hash table
+ *
+ * @chtable: The hash table to destroy/free
+ *
+ * No other thread may be using the table at this point.
+ */
+void ac_htable_concurrent_destroy(const ac_htable_concurrent_t *chtable)
+{
+	u32 i;
+
+	for (i = 0; i < chtable->nr_shards; i++) {
+		struct ac_htable_shard *shard = &chtable->shards[i];
+
+		htable_free_entries(&shard->htable);
+		pthread_rwlock_destroy(&shard->lock);
+	}
+
+	free(chtable->shards);
+	free((void *)chtable);
 }
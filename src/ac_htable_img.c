@@ -0,0 +1,461 @@
+/* SPDX-License-Identifier: LGPL-2.1 */
+
+/*
+ * ac_htable_img.c - Read-only hash table images
+ *
+ * A hash table can be saved to a file as a flat image made up of a
+ * header, an open addressing (Robin Hood) slot array and the keys/data.
+ * Everything is referred to by its offset from the start of the file, so
+ * the image can be mmap(2)'d and looked up in directly without building
+ * anything.
+ *
+ * The hash values are computed with ac_hash_buf_seed() using a seed
+ * stored in the image, so they don't depend on the hash function of the
+ * table that was saved or the seed of the process using the image.
+ *
+ * Images are in host byte order.
+ *
+ * Copyright (c) 2026	Andrew Clayton <ac@sigsegv.uk>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "include/libac.h"
+
+#define HTABLE_IMG_MAGIC	"ACHTIMG"
+#define HTABLE_IMG_VERSION	2
+/* Used to detect an image from a host with a different byte order */
+#define HTABLE_IMG_BOM		0x01020304U
+
+#define HTABLE_IMG_MIN_SZ	16
+#define HTABLE_IMG_MAX_SZ	(1U << 31)
+#define HTABLE_IMG_MAX_LOAD	0.8
+
+/* 2^64 / phi, used for Fibonacci hashing */
+#define HTABLE_IMG_FIB_MUL	0x9E3779B97F4A7C15ULL
+
+/* Keys & data are 8 byte aligned in the image */
+#define HTABLE_IMG_ALIGN(len)	(((len) + 7) & ~(u64)7)
+
+struct ac_htable_img_hdr {
+	char magic[8];
+	u32 version;
+	u32 bom;
+
+	u64 seed;
+	u64 count;
+	u64 size;
+	u32 key_sz;
+	u32 data_sz;
+
+	u64 slots_off;
+	u64 file_sz;
+};
+
+/*
+ * ->dist is the distance (+1) of the entry from its home slot, 0 marks
+ * an empty slot. ->data_off is 0 for NULL data, ->data_len includes the
+ * terminating NUL of string data.
+ */
+struct ac_htable_img_slot {
+	u64 hash;
+	u64 key_off;
+	u64 data_off;
+	u32 key_len;
+	u32 data_len;
+	u32 dist;
+	u32 pad;
+};
+
+struct htable_img_save {
+	const ac_htable_img_t *img;
+	struct ac_htable_img_slot *slots;
+	u64 off;
+
+	FILE *fp;
+	int err;
+};
+
+static inline u32 htable_img_slot(const ac_htable_img_t *img, u64 hash)
+{
+	return (hash * HTABLE_IMG_FIB_MUL) >> img->shift;
+}
+
+static inline size_t htable_img_key_len(const ac_htable_img_t *img,
+					const void *key)
+{
+	return img->key_sz ? img->key_sz : strlen(key);
+}
+
+/* Strings are stored with their terminating NUL */
+static inline size_t htable_img_data_len(const ac_htable_img_t *img,
+					 const void *data)
+{
+	return img->data_sz ? img->data_sz : strlen(data) + 1;
+}
+
+static void htable_img_place(const ac_htable_img_t *img,
+			     struct ac_htable_img_slot *slots,
+			     struct ac_htable_img_slot ins)
+{
+	u32 mask = img->size - 1;
+	u32 idx = htable_img_slot(img, ins.hash);
+
+	ins.dist = 1;
+	for (;;) {
+		struct ac_htable_img_slot *slot = &slots[idx];
+
+		if (slot->dist == 0) {
+			*slot = ins;
+			return;
+		}
+
+		if (slot->dist < ins.dist) {
+			struct ac_htable_img_slot tmp = *slot;
+
+			*slot = ins;
+			ins = tmp;
+		}
+
+		idx = (idx + 1) & mask;
+		ins.dist++;
+	}
+}
+
+/* First pass, lay out the keys/data and fill in the slots */
+static void htable_img_add_entry(void *key, void *data, void *user_data)
+{
+	struct htable_img_save *save = user_data;
+	const ac_htable_img_t *img = save->img;
+	struct ac_htable_img_slot slot = { 0 };
+
+	slot.key_len = htable_img_key_len(img, key);
+	slot.hash = ac_hash_buf_seed(key, slot.key_len, img->seed);
+	slot.key_off = save->off;
+	save->off += HTABLE_IMG_ALIGN(slot.key_len);
+	if (data) {
+		slot.data_len = htable_img_data_len(img, data);
+		slot.data_off = save->off;
+		save->off += HTABLE_IMG_ALIGN(slot.data_len);
+	}
+
+	htable_img_place(img, save->slots, slot);
+}
+
+static void htable_img_write(struct htable_img_save *save, const void *buf,
+			     size_t len)
+{
+	static const u8 pad[8];
+	size_t padding = HTABLE_IMG_ALIGN(len) - len;
+
+	if (save->err)
+		return;
+
+	/* fwrite(3) needn't set errno on a short write */
+	errno = 0;
+	if (fwrite(buf, 1, len, save->fp) != len ||
+	    fwrite(pad, 1, padding, save->fp) != padding)
+		save->err = errno ? errno : EIO;
+}
+
+/* Second pass, in the same order as the first */
+static void htable_img_write_entry(void *key, void *data, void *user_data)
+{
+	struct htable_img_save *save = user_data;
+	const ac_htable_img_t *img = save->img;
+
+	htable_img_write(save, key, htable_img_key_len(img, key));
+	if (data)
+		htable_img_write(save, data, htable_img_data_len(img, data));
+}
+
+/**
+ * ac_htable_save - save a hash table to a file as a read-only image
+ *
+ * @htable: The hash table to save
+ * @path: The file to save it to
+ * @key_sz: The size of the keys or 0 for NUL terminated string keys
+ * @data_sz: The size of the data or 0 for NUL terminated string data
+ *
+ * The keys/data (the things pointed to, not the pointers) are copied into
+ * the image. The image can then be opened and looked up in with
+ * ac_htable_img_open() & ac_htable_img_lookup().
+ *
+ * The image is written to a temporary file which is then renamed to @path,
+ * so any existing image is replaced atomically and processes that have it
+ * mapped are unaffected. It is created with mode 0666, minus the umask.
+ *
+ * Returns:
+ *
+ * 0 on success or -1 on error (errno will be set)
+ */
+int ac_htable_save(const ac_htable_t *htable, const char *path, u32 key_sz,
+		   u32 data_sz)
+{
+	ac_htable_img_t img = { .key_sz = key_sz, .data_sz = data_sz };
+	struct htable_img_save save = { .img = &img };
+	struct ac_htable_img_hdr hdr = { .magic = HTABLE_IMG_MAGIC };
+	char *tmp;
+	u64 size = HTABLE_IMG_MIN_SZ;
+	int fd;
+	int err;
+
+	while ((double)size * HTABLE_IMG_MAX_LOAD < htable->count) {
+		size <<= 1;
+		if (size > HTABLE_IMG_MAX_SZ) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	if (getrandom(&img.seed, sizeof(img.seed), 0) != sizeof(img.seed))
+		return -1;
+	img.size = size;
+	img.shift = 64 - __builtin_ctzll(size);
+
+	hdr.version = HTABLE_IMG_VERSION;
+	hdr.bom = HTABLE_IMG_BOM;
+	hdr.seed = img.seed;
+	hdr.count = htable->count;
+	hdr.size = size;
+	hdr.key_sz = key_sz;
+	hdr.data_sz = data_sz;
+	hdr.slots_off = HTABLE_IMG_ALIGN(sizeof(hdr));
+
+	save.slots = calloc(size, sizeof(struct ac_htable_img_slot));
+	save.off = hdr.slots_off + size * sizeof(struct ac_htable_img_slot);
+	ac_htable_foreach(htable, htable_img_add_entry, &save);
+	hdr.file_sz = save.off;
+
+	/* Not mkstemp(3), its 0600 mode would ignore the umask */
+	do {
+		u32 rnd;
+
+		if (getrandom(&rnd, sizeof(rnd), 0) != sizeof(rnd)) {
+			free(save.slots);
+			return -1;
+		}
+		if (asprintf(&tmp, "%s.%08x", path, rnd) == -1) {
+			free(save.slots);
+			return -1;
+		}
+		fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+		if (fd == -1) {
+			err = errno;
+			free(tmp);
+		}
+	} while (fd == -1 && err == EEXIST);
+	if (fd == -1) {
+		free(save.slots);
+		errno = err;
+		return -1;
+	}
+	save.fp = fdopen(fd, "w");
+	if (!save.fp) {
+		err = errno;
+		close(fd);
+		goto out_unlink;
+	}
+
+	htable_img_write(&save, &hdr, sizeof(hdr));
+	htable_img_write(&save, save.slots,
+			 size * sizeof(struct ac_htable_img_slot));
+	ac_htable_foreach(htable, htable_img_write_entry, &save);
+
+	if (fflush(save.fp) == EOF && !save.err)
+		save.err = errno;
+	if (!save.err && fsync(fd) == -1)
+		save.err = errno;
+	fclose(save.fp);
+
+	err = save.err;
+	if (!err && rename(tmp, path) == -1)
+		err = errno;
+	if (!err)
+		goto out_free;
+
+out_unlink:
+	unlink(tmp);
+out_free:
+	free(tmp);
+	free(save.slots);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool htable_img_valid(const struct ac_htable_img_hdr *hdr,
+			     size_t len)
+{
+	if (len < sizeof(struct ac_htable_img_hdr))
+		return false;
+	if (memcmp(hdr->magic, HTABLE_IMG_MAGIC, sizeof(hdr->magic)) != 0)
+		return false;
+	if (hdr->version != HTABLE_IMG_VERSION ||
+	    hdr->bom != HTABLE_IMG_BOM)
+		return false;
+	if (hdr->file_sz != len)
+		return false;
+	if (hdr->size < HTABLE_IMG_MIN_SZ || hdr->size > HTABLE_IMG_MAX_SZ ||
+	    (hdr->size & (hdr->size - 1)) || hdr->count >= hdr->size)
+		return false;
+	if (hdr->slots_off < sizeof(struct ac_htable_img_hdr) ||
+	    hdr->slots_off > len ||
+	    (len - hdr->slots_off) / sizeof(struct ac_htable_img_slot) <
+	    hdr->size)
+		return false;
+
+	return true;
+}
+
+/**
+ * ac_htable_img_open - open a hash table image
+ *
+ * @path: The image file, as created by ac_htable_save()
+ *
+ * The image is mmap(2)'d read-only, nothing is read in up front.
+ *
+ * Returns:
+ *
+ * A pointer to the opened image or NULL on error (errno will be set, to
+ * EINVAL if the file isn't a valid image). Should be closed with
+ * ac_htable_img_close()
+ */
+ac_htable_img_t *ac_htable_img_open(const char *path)
+{
+	ac_htable_img_t *img;
+	const struct ac_htable_img_hdr *hdr;
+	struct stat sb;
+	void *map;
+	int fd;
+	int err;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &sb) == -1)
+		goto out_close;
+	if ((size_t)sb.st_size < sizeof(struct ac_htable_img_hdr)) {
+		errno = EINVAL;
+		goto out_close;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto out_close;
+	close(fd);
+
+	hdr = map;
+	if (!htable_img_valid(hdr, sb.st_size)) {
+		munmap(map, sb.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	img = malloc(sizeof(ac_htable_img_t));
+	img->map = map;
+	img->len = sb.st_size;
+	img->slots = (const struct ac_htable_img_slot *)
+		     ((const u8 *)map + hdr->slots_off);
+	img->seed = hdr->seed;
+	img->count = hdr->count;
+	img->size = hdr->size;
+	img->key_sz = hdr->key_sz;
+	img->data_sz = hdr->data_sz;
+	img->shift = 64 - __builtin_ctz(img->size);
+
+	return img;
+
+out_close:
+	err = errno;
+	close(fd);
+	errno = err;
+
+	return NULL;
+}
+
+/* Check that len bytes at off lie within the image */
+static inline bool htable_img_in_map(const ac_htable_img_t *img, u64 off,
+				     u64 len)
+{
+	return off <= img->len && img->len - off >= len;
+}
+
+/**
+ * ac_htable_img_lookup - lookup an entry in a hash table image
+ *
+ * @img: The image to lookup from
+ * @key: The key to use, of the key size the image was saved with or a
+ *       NUL terminated string
+ *
+ * The image isn't checked up front beyond its header, instead each lookup
+ * only probes at most the whole slot array and checks any key or data it
+ * uses lies within the image (and that string data is NUL terminated), so
+ * a corrupt image can give wrong answers but not crash or hang.
+ *
+ * Returns:
+ *
+ * A pointer to the entries data in the image if found, NULL if not. The
+ * data is only valid until the image is closed
+ */
+const void *ac_htable_img_lookup(const ac_htable_img_t *img, const void *key)
+{
+	const u8 *map = img->map;
+	size_t key_len = htable_img_key_len(img, key);
+	u64 hash = ac_hash_buf_seed(key, key_len, img->seed);
+	u32 mask = img->size - 1;
+	u32 idx = htable_img_slot(img, hash);
+	const struct ac_htable_img_slot *slot;
+	u64 dist;
+
+	for (dist = 1; dist <= img->size; dist++) {
+		slot = &img->slots[idx];
+
+		if (slot->dist < dist)
+			return NULL;
+		if (slot->dist == dist && slot->hash == hash &&
+		    slot->key_len == key_len &&
+		    htable_img_in_map(img, slot->key_off, key_len) &&
+		    memcmp(map + slot->key_off, key, key_len) == 0)
+			break;
+
+		idx = (idx + 1) & mask;
+	}
+	if (dist > img->size)
+		return NULL;
+
+	if (!slot->data_off || !slot->data_len ||
+	    !htable_img_in_map(img, slot->data_off, slot->data_len))
+		return NULL;
+	if (img->data_sz ? slot->data_len != img->data_sz :
+	    map[slot->data_off + slot->data_len - 1] != '\0')
+		return NULL;
+
+	return map + slot->data_off;
+}
+
+/**
+ * ac_htable_img_close - close a hash table image
+ *
+ * @img: The image to close
+ */
+void ac_htable_img_close(ac_htable_img_t *img)
+{
+	munmap((void *)img->map, img->len);
+	free(img);
+}
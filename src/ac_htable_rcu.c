@@ -0,0 +1,463 @@
+/* SPDX-License-Identifier: LGPL-2.1 */
+
+/*
+ * ac_htable_rcu.c - Hash Table with lock-free lookups
+ *
+ * This is a chained hash table for read mostly data. Writers are
+ * serialised by a mutex and publish their changes with release stores,
+ * lookups take no locks and do no atomic read-modify-write operations.
+ *
+ * Removed (or replaced) entries have their key/data free'd once no reader
+ * can be looking at them, see ac_rcu.c
+ *
+ * The nodes come from a per-table pool, allocated in chunks which are
+ * only given back by ac_htable_rcu_destroy().
+ *
+ * Copyright (c) 2026	Andrew Clayton <ac@sigsegv.uk>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "include/libac.h"
+#include "rcu.h"
+
+#define HTABLE_RCU_MIN_SZ	16
+/* Shrink when the table is less than 1/8th full */
+#define HTABLE_RCU_SHRINK_DEN	8
+
+/* 2^64 / phi, used for Fibonacci hashing */
+#define HTABLE_RCU_FIB_MUL	0x9E3779B97F4A7C15ULL
+
+/* Number of nodes allocated at a time */
+#define HTABLE_RCU_CHUNK_NR	128
+
+struct ac_htable_rcu_node {
+	struct ac_htable_rcu_node *next;
+
+	void *key;
+	void *data;
+	u32 hash;
+
+	ac_htable_rcu_t *htable;
+	struct rcu_head rcu;
+};
+
+struct ac_htable_rcu_chunk {
+	struct ac_htable_rcu_chunk *next;
+
+	struct ac_htable_rcu_node nodes[HTABLE_RCU_CHUNK_NR];
+};
+
+struct ac_htable_rcu_tbl {
+	u32 size;
+	u8 shift;
+
+	struct rcu_head rcu;
+	struct ac_htable_rcu_node *buckets[];
+};
+
+static inline u32 htable_rcu_bucket(const struct ac_htable_rcu_tbl *tbl,
+				    u32 hash)
+{
+	return (hash * HTABLE_RCU_FIB_MUL) >> tbl->shift;
+}
+
+static struct ac_htable_rcu_tbl *htable_rcu_tbl_new(u32 size)
+{
+	struct ac_htable_rcu_tbl *tbl;
+
+	tbl = calloc(1, sizeof(struct ac_htable_rcu_tbl) +
+			size * sizeof(struct ac_htable_rcu_node *));
+	tbl->size = size;
+	tbl->shift = 64 - __builtin_ctz(size);
+
+	return tbl;
+}
+
+static void htable_rcu_free_tbl(struct rcu_head *head)
+{
+	free(container_of(head, struct ac_htable_rcu_tbl, rcu));
+}
+
+/*
+ * Nodes are free'd from the RCU callbacks, which can run in any thread,
+ * by pushing them onto ->freed_nodes. A writer takes the whole list in
+ * one go when ->free_nodes runs dry, so there's no ABA problem.
+ *
+ * Called with htable->lock held.
+ */
+static struct ac_htable_rcu_node *htable_rcu_node_alloc(
+						ac_htable_rcu_t *htable)
+{
+	struct ac_htable_rcu_node *node = htable->free_nodes;
+
+	if (!node)
+		node = __atomic_exchange_n(&htable->freed_nodes, NULL,
+					   __ATOMIC_ACQUIRE);
+	if (!node) {
+		struct ac_htable_rcu_chunk *chunk;
+		int i;
+
+		chunk = malloc(sizeof(struct ac_htable_rcu_chunk));
+		chunk->next = htable->chunks;
+		htable->chunks = chunk;
+
+		for (i = 0; i < HTABLE_RCU_CHUNK_NR - 1; i++)
+			chunk->nodes[i].next = &chunk->nodes[i + 1];
+		chunk->nodes[HTABLE_RCU_CHUNK_NR - 1].next = NULL;
+		node = &chunk->nodes[0];
+	}
+
+	htable->free_nodes = node->next;
+
+	return node;
+}
+
+static void htable_rcu_node_release(struct ac_htable_rcu_node *node)
+{
+	ac_htable_rcu_t *htable = node->htable;
+	struct ac_htable_rcu_node *head;
+
+	head = __atomic_load_n(&htable->freed_nodes, __ATOMIC_RELAXED);
+	do {
+		node->next = head;
+	} while (!__atomic_compare_exchange_n(&htable->freed_nodes, &head,
+					      node, true, __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+static void htable_rcu_free_key_data(const ac_htable_rcu_t *htable,
+				     const struct ac_htable_rcu_node *node)
+{
+	if (htable->free_key_func)
+		htable->free_key_func(node->key);
+	if (htable->free_data_func)
+		htable->free_data_func(node->data);
+}
+
+/* Free a node that has been replaced by a copy, leaving its key/data */
+static void htable_rcu_free_node(struct rcu_head *head)
+{
+	htable_rcu_node_release(container_of(head, struct ac_htable_rcu_node,
+					     rcu));
+}
+
+/* Free a node that has been removed (or replaced) along with its key/data */
+static void htable_rcu_free_entry(struct rcu_head *head)
+{
+	struct ac_htable_rcu_node *node = container_of(
+					head, struct ac_htable_rcu_node, rcu);
+
+	htable_rcu_free_key_data(node->htable, node);
+	htable_rcu_node_release(node);
+}
+
+/* Called with htable->lock held */
+static struct ac_htable_rcu_node *htable_rcu_node_new(ac_htable_rcu_t *htable,
+						      void *key, void *data,
+						      u32 hash)
+{
+	struct ac_htable_rcu_node *node = htable_rcu_node_alloc(htable);
+
+	node->key = key;
+	node->data = data;
+	node->hash = hash;
+	node->htable = htable;
+
+	return node;
+}
+
+/*
+ * Readers may still be walking the old table, so rather than relinking
+ * the existing nodes, build a new table of copies and swap it in.
+ *
+ * Called with htable->lock held.
+ */
+static void htable_rcu_resize(ac_htable_rcu_t *htable, u32 size)
+{
+	struct ac_htable_rcu_tbl *old = htable->tbl;
+	struct ac_htable_rcu_tbl *tbl = htable_rcu_tbl_new(size);
+	u32 i;
+
+	for (i = 0; i < old->size; i++) {
+		struct ac_htable_rcu_node *node;
+
+		for (node = old->buckets[i]; node; node = node->next) {
+			struct ac_htable_rcu_node *new;
+			u32 bucket = htable_rcu_bucket(tbl, node->hash);
+
+			new = htable_rcu_node_new(htable, node->key,
+						  node->data, node->hash);
+			new->next = tbl->buckets[bucket];
+			tbl->buckets[bucket] = new;
+		}
+	}
+
+	__atomic_store_n(&htable->tbl, tbl, __ATOMIC_RELEASE);
+
+	for (i = 0; i < old->size; i++) {
+		struct ac_htable_rcu_node *node = old->buckets[i];
+
+		while (node) {
+			struct ac_htable_rcu_node *next = node->next;
+
+			rcu_retire(&node->rcu, htable_rcu_free_node);
+			node = next;
+		}
+	}
+	rcu_retire(&old->rcu, htable_rcu_free_tbl);
+}
+
+/*
+ * Find the link pointing to the node with the given key.
+ *
+ * Called with htable->lock held.
+ */
+static struct ac_htable_rcu_node **htable_rcu_find(
+					const ac_htable_rcu_t *htable,
+					const void *key, u32 hash)
+{
+	struct ac_htable_rcu_tbl *tbl = htable->tbl;
+	struct ac_htable_rcu_node **pp;
+	struct ac_htable_rcu_node *node;
+
+	pp = &tbl->buckets[htable_rcu_bucket(tbl, hash)];
+	while ((node = *pp) != NULL) {
+		if (node->hash == hash && htable->key_cmp(node->key, key) == 0)
+			return pp;
+		pp = &node->next;
+	}
+
+	return pp;
+}
+
+/**
+ * ac_htable_rcu_new - create a new hash table with lock-free lookups
+ *
+ * @hash_func: Pointer to a hashing function
+ * @key_cmp: Pointer to a key comparison function
+ * @free_key_func: Optional pointer to a key free'ing function
+ * @free_data_func: Optional pointer to a data free'ing function
+ *
+ * The free functions are called deferred, once no reader can still be
+ * looking at the entry.
+ *
+ * Returns:
+ *
+ * A pointer to a newly created hash table. Should be free'd with
+ * ac_htable_rcu_destroy()
+ */
+ac_htable_rcu_t *ac_htable_rcu_new(u32 (*hash_func)(const void *key),
+				   int (*key_cmp)(const void *a, const void *b),
+				   void (*free_key_func)(void *key),
+				   void (*free_data_func)(void *data))
+{
+	ac_htable_rcu_t *htable = malloc(sizeof(ac_htable_rcu_t));
+
+	htable->tbl = htable_rcu_tbl_new(HTABLE_RCU_MIN_SZ);
+	htable->count = 0;
+	htable->chunks = NULL;
+	htable->free_nodes = NULL;
+	htable->freed_nodes = NULL;
+	pthread_mutex_init(&htable->lock, NULL);
+	htable->hash_func = hash_func;
+	htable->key_cmp = key_cmp;
+	htable->free_key_func = free_key_func;
+	htable->free_data_func = free_data_func;
+
+	return htable;
+}
+
+/**
+ * ac_htable_rcu_insert - inserts a new entry into a hash table
+ *
+ * @htable: The hash table to insert into
+ * @key: The key to use
+ * @data: The data to store
+ *
+ * If you try and insert with an already existing key, the old entry will
+ * be replaced and its key/data free'd once no readers are using it
+ */
+void ac_htable_rcu_insert(ac_htable_rcu_t *htable, void *key, void *data)
+{
+	u32 hash = htable->hash_func(key);
+	struct ac_htable_rcu_node **pp;
+	struct ac_htable_rcu_node *node;
+	struct ac_htable_rcu_node *old;
+
+	pthread_mutex_lock(&htable->lock);
+	node = htable_rcu_node_new(htable, key, data, hash);
+	pp = htable_rcu_find(htable, key, hash);
+	old = *pp;
+	if (old) {
+		node->next = old->next;
+		__atomic_store_n(pp, node, __ATOMIC_RELEASE);
+		rcu_retire(&old->rcu, htable_rcu_free_entry);
+	} else {
+		struct ac_htable_rcu_tbl *tbl = htable->tbl;
+		u32 bucket = htable_rcu_bucket(tbl, hash);
+
+		node->next = tbl->buckets[bucket];
+		__atomic_store_n(&tbl->buckets[bucket], node,
+				 __ATOMIC_RELEASE);
+		htable->count++;
+		if (htable->count > tbl->size)
+			htable_rcu_resize(htable, tbl->size * 2);
+	}
+	pthread_mutex_unlock(&htable->lock);
+
+	rcu_reclaim();
+}
+
+/**
+ * ac_htable_rcu_remove - remove an entry from a hash table
+ *
+ * @htable: The hash table to remove from
+ * @key: The key to use
+ *
+ * The entries key/data are free'd once no readers are using it.
+ *
+ * Returns:
+ *
+ * true if the entry was removed, false otherwise
+ */
+bool ac_htable_rcu_remove(ac_htable_rcu_t *htable, const void *key)
+{
+	u32 hash = htable->hash_func(key);
+	struct ac_htable_rcu_node **pp;
+	struct ac_htable_rcu_node *node;
+	u32 size;
+
+	pthread_mutex_lock(&htable->lock);
+	pp = htable_rcu_find(htable, key, hash);
+	node = *pp;
+	if (!node) {
+		pthread_mutex_unlock(&htable->lock);
+		return false;
+	}
+
+	__atomic_store_n(pp, node->next, __ATOMIC_RELEASE);
+	rcu_retire(&node->rcu, htable_rcu_free_entry);
+	htable->count--;
+
+	size = htable->tbl->size;
+	if (size > HTABLE_RCU_MIN_SZ &&
+	    htable->count < size / HTABLE_RCU_SHRINK_DEN)
+		htable_rcu_resize(htable, size / 2);
+	pthread_mutex_unlock(&htable->lock);
+
+	rcu_reclaim();
+
+	return true;
+}
+
+/**
+ * ac_htable_rcu_lookup - lookup an entry in a hash table
+ *
+ * @htable: The hash table to lookup from
+ * @key: The key to use
+ *
+ * This takes no locks and does no atomic read-modify-write operations.
+ *
+ * If the table has a free_data_func, the lookup and any use of the
+ * returned data should be done between ac_rcu_read_lock() and
+ * ac_rcu_read_unlock(), otherwise it may be free'd from under you.
+ *
+ * Returns:
+ *
+ * A pointer to the entries data if found, NULL if not
+ */
+void *ac_htable_rcu_lookup(const ac_htable_rcu_t *htable, const void *key)
+{
+	u32 hash = htable->hash_func(key);
+	const struct ac_htable_rcu_tbl *tbl;
+	const struct ac_htable_rcu_node *node;
+	void *data = NULL;
+
+	ac_rcu_read_lock();
+	tbl = __atomic_load_n(&htable->tbl, __ATOMIC_ACQUIRE);
+	node = __atomic_load_n(&tbl->buckets[htable_rcu_bucket(tbl, hash)],
+			       __ATOMIC_ACQUIRE);
+	while (node) {
+		if (node->hash == hash &&
+		    htable->key_cmp(node->key, key) == 0) {
+			data = node->data;
+			break;
+		}
+		node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	}
+	ac_rcu_read_unlock();
+
+	return data;
+}
+
+/**
+ * ac_htable_rcu_foreach - iterate over each entry in a hash table
+ *
+ * @htable: The hash table to iterate over
+ * @action: A pointer to a function to call for each entry. This will get the
+ *          key, data and optional user supplied data as arguments
+ * @user_data: Optional pointer to data to pass to the above function
+ *
+ * This runs as a reader, entries inserted or removed by other threads
+ * while iterating may or may not be seen.
+ */
+void ac_htable_rcu_foreach(const ac_htable_rcu_t *htable,
+			   void (*action)(void *key, void *value,
+					  void *user_data),
+			   void *user_data)
+{
+	const struct ac_htable_rcu_tbl *tbl;
+	u32 i;
+
+	ac_rcu_read_lock();
+	tbl = __atomic_load_n(&htable->tbl, __ATOMIC_ACQUIRE);
+	for (i = 0; i < tbl->size; i++) {
+		const struct ac_htable_rcu_node *node;
+
+		node = __atomic_load_n(&tbl->buckets[i], __ATOMIC_ACQUIRE);
+		while (node) {
+			action(node->key, node->data, user_data);
+			node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+		}
+	}
+	ac_rcu_read_unlock();
+}
+
+/**
+ * ac_htable_rcu_destroy - destroy the given hash table
+ *
+ * @htable: The hash table to destroy/free
+ *
+ * No other thread may be using the table at this point. Any deferred
+ * free's are completed first and then all the nodes are free'd in one go.
+ */
+void ac_htable_rcu_destroy(const ac_htable_rcu_t *htable)
+{
+	struct ac_htable_rcu_tbl *tbl = htable->tbl;
+	struct ac_htable_rcu_chunk *chunk = htable->chunks;
+	u32 i;
+
+	ac_rcu_barrier();
+
+	for (i = 0; i < tbl->size; i++) {
+		const struct ac_htable_rcu_node *node;
+
+		for (node = tbl->buckets[i]; node; node = node->next)
+			htable_rcu_free_key_data(htable, node);
+	}
+
+	while (chunk) {
+		struct ac_htable_rcu_chunk *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+
+	free(tbl);
+	pthread_mutex_destroy((pthread_mutex_t *)&htable->lock);
+	free((void *)htable);
+}
@@ -19,6 +19,7 @@
 #endif
 #include <time.h>
 #include <errno.h>
+#include <sys/random.h>
 
 #include "include/libac.h"
 #include "platform.h"
@@ -265,13 +266,219 @@ int ac_misc_shuffle(void *base, size_t nmemb, size_t size,
 }
 
 #define GOLDEN_MUL	0x61C88647	/* From the Linux kernel */
+#define GOLDEN_MUL64	0x61C8864680B583EBULL
+
+/*
+ * The below is based on wyhash (final version 4) by Wang Yi
+ * https://github.com/wangyi-fudan/wyhash, released into the public domain.
+ *
+ * It works a word at a time and mixes with 64x64->128 bit multiplies.
+ */
+static const u64 wy_secret[4] = {
+	0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+	0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+/* Per-process hash seed, see ac_hash_set_seed() */
+static u64 hash_seed;
+
+static inline void wy_mum(u64 *a, u64 *b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = *a;
+
+	r *= *b;
+	*a = (u64)r;
+	*b = (u64)(r >> 64);
+#else
+	u64 ha = *a >> 32;
+	u64 hb = *b >> 32;
+	u64 la = (u32)*a;
+	u64 lb = (u32)*b;
+	u64 rh = ha * hb;
+	u64 rm0 = ha * lb;
+	u64 rm1 = hb * la;
+	u64 rl = la * lb;
+	u64 t = rl + (rm0 << 32);
+	u64 c = t < rl;
+	u64 lo = t + (rm1 << 32);
+
+	c += lo < t;
+	*a = lo;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline u64 wy_mix(u64 a, u64 b)
+{
+	wy_mum(&a, &b);
+
+	return a ^ b;
+}
+
+static inline u64 wy_r8(const u8 *p)
+{
+	u64 v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+static inline u64 wy_r4(const u8 *p)
+{
+	u32 v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+static inline u64 wy_r3(const u8 *p, size_t k)
+{
+	return ((u64)p[0] << 16) | ((u64)p[k >> 1] << 8) | p[k - 1];
+}
+
+static u64 wyhash(const void *key, size_t len, u64 seed)
+{
+	const u8 *p = key;
+	u64 a;
+	u64 b;
+
+	seed ^= wy_mix(seed ^ wy_secret[0], wy_secret[1]);
+
+	if (len <= 16) {
+		if (len >= 4) {
+			size_t off = (len >> 3) << 2;
+
+			a = (wy_r4(p) << 32) | wy_r4(p + off);
+			b = (wy_r4(p + len - 4) << 32) |
+			    wy_r4(p + len - 4 - off);
+		} else if (len > 0) {
+			a = wy_r3(p, len);
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = len;
+
+		if (i > 48) {
+			u64 see1 = seed;
+			u64 see2 = seed;
+
+			do {
+				seed = wy_mix(wy_r8(p) ^ wy_secret[1],
+					      wy_r8(p + 8) ^ seed);
+				see1 = wy_mix(wy_r8(p + 16) ^ wy_secret[2],
+					      wy_r8(p + 24) ^ see1);
+				see2 = wy_mix(wy_r8(p + 32) ^ wy_secret[3],
+					      wy_r8(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = wy_mix(wy_r8(p) ^ wy_secret[1],
+				      wy_r8(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = wy_r8(p + i - 16);
+		b = wy_r8(p + i - 8);
+	}
+
+	a ^= wy_secret[1];
+	b ^= seed;
+	wy_mum(&a, &b);
+
+	return wy_mix(a ^ wy_secret[0] ^ len, b ^ wy_secret[1]);
+}
+
+static inline u32 hash_fold32(u64 hash)
+{
+	return hash ^ (hash >> 32);
+}
+
+/**
+ * ac_hash_set_seed - set the seed used by the hash functions
+ *
+ * @seed: The seed to use
+ *
+ * This affects ac_hash_buf(), ac_hash_func_str() & ac_hash_func_u64() and
+ * should be called before any hash tables using them are created.
+ */
+void ac_hash_set_seed(u64 seed)
+{
+	hash_seed = seed;
+}
+
+/**
+ * ac_hash_set_random_seed - set a random seed for the hash functions
+ *
+ * Using a random per-process seed makes it impractical for an attacker to
+ * produce keys that all hash to the same value (hash flooding).
+ *
+ * This should be called before any hash tables are created.
+ *
+ * Returns:
+ *
+ * 0 on success or -1 on failure (errno will be set)
+ */
+int ac_hash_set_random_seed(void)
+{
+	u64 seed;
+	ssize_t ret;
+
+	ret = getrandom(&seed, sizeof(seed), 0);
+	if (ret != sizeof(seed))
+		return -1;
+
+	hash_seed = seed;
+
+	return 0;
+}
+
+/**
+ * ac_hash_buf - create a hash value for a buffer of a given length
+ *
+ * @buf: The data to hash
+ * @len: The length of @buf
+ *
+ * Returns:
+ *
+ * A u64 hash value
+ */
+u64 ac_hash_buf(const void *buf, size_t len)
+{
+	return wyhash(buf, len, hash_seed);
+}
+
+/**
+ * ac_hash_buf_seed - create a hash value for a buffer with a given seed
+ *
+ * @buf: The data to hash
+ * @len: The length of @buf
+ * @seed: The seed to use
+ *
+ * Like ac_hash_buf() but independent of the per-process seed, for when the
+ * hash values need to be the same across processes.
+ *
+ * Returns:
+ *
+ * A u64 hash value
+ */
+u64 ac_hash_buf_seed(const void *buf, size_t len, u64 seed)
+{
+	return wyhash(buf, len, seed);
+}
+
 /**
  * ac_hash_func_str - create a hash value for a given string
  *
  * @key: The string/key to hash
  *
- * This is the Jenkins One At A Time Hash function
- *
  * This function is suitable for use in ac_htable_new()
  *
  * Returns:
@@ -280,21 +487,94 @@ int ac_misc_shuffle(void *base, size_t nmemb, size_t size,
  */
 u32 ac_hash_func_str(const void *key)
 {
-	size_t i = 0;
-	u32 hash = 0;
-	const char *k = key;
-	size_t len = strlen(k);
-
-	while (i != len) {
-		hash += k[i++];
-		hash += hash << 10;
-		hash ^= hash >> 6;
-	}
-	hash += hash << 3;
-	hash ^= hash >> 11;
-	hash += hash << 15;
+	return hash_fold32(wyhash(key, strlen(key), hash_seed));
+}
+
+/**
+ * ac_hash_func_u64 - create a hash value for a given u64
+ *
+ * @key: The u64/key to hash
+ *
+ * This function is suitable for use in ac_htable_new()
+ *
+ * Returns:
+ *
+ * A u32 hash value
+ */
+u32 ac_hash_func_u64(const void *key)
+{
+	const u64 k = *(const u64 *)key;
+
+	return hash_fold32(wy_mix(k ^ hash_seed ^ wy_secret[0],
+				  wy_secret[1]));
+}
+
+/**
+ * ac_hash64_func_str - create a 64-bit hash value for a given string
+ *
+ * @key: The string/key to hash
+ *
+ * This function is suitable for use in ac_htable_new64()
+ *
+ * Returns:
+ *
+ * A u64 hash value
+ */
+u64 ac_hash64_func_str(const void *key)
+{
+	return wyhash(key, strlen(key), hash_seed);
+}
+
+/**
+ * ac_hash64_func_u64 - create a 64-bit hash value for a given u64
+ *
+ * @key: The u64/key to hash
+ *
+ * This function is suitable for use in ac_htable_new64()
+ *
+ * Returns:
+ *
+ * A u64 hash value
+ */
+u64 ac_hash64_func_u64(const void *key)
+{
+	const u64 k = *(const u64 *)key;
+
+	return wy_mix(k ^ hash_seed ^ wy_secret[0], wy_secret[1]);
+}
 
-	return hash;
+/**
+ * ac_hash64_func_u32 - create a 64-bit hash value for a given u32
+ *
+ * @key: The u32/key to hash
+ *
+ * This function is suitable for use in ac_htable_new64()
+ *
+ * Returns:
+ *
+ * A u64 hash value
+ */
+u64 ac_hash64_func_u32(const void *key)
+{
+	const u64 k = *(const u32 *)key;
+
+	return k * GOLDEN_MUL64;
+}
+
+/**
+ * ac_hash64_func_ptr - create a 64-bit hash for a given pointer
+ *
+ * @key: The pointer/key to hash
+ *
+ * This function is suitable for use in ac_htable_new64()
+ *
+ * Returns:
+ *
+ * A u64 hash value
+ */
+u64 ac_hash64_func_ptr(const void *key)
+{
+	return (u64)(uintptr_t)key * GOLDEN_MUL64;
 }
 
 /**
@@ -0,0 +1,295 @@
+/* SPDX-License-Identifier: LGPL-2.1 */
+
+/*
+ * ac_rcu.c - Epoch based deferred reclamation
+ *
+ * Readers announce the global epoch they observed in a per-thread record
+ * using only plain (atomic) loads and stores, no locks and no atomic
+ * read-modify-write operations.
+ *
+ * Writers retire objects they have unlinked into a list for the current
+ * epoch. The global epoch is only advanced once every active reader has
+ * observed it, so anything retired two epochs ago can no longer be
+ * referenced by any reader and is free'd.
+ *
+ * Copyright (c) 2026	Andrew Clayton <ac@sigsegv.uk>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "include/libac.h"
+#include "rcu.h"
+
+#define RCU_CACHELINE_SZ	64
+#define RCU_NR_LIMBO		3
+
+/* Epochs go up in 2's, bit 0 in a threads epoch marks it as active */
+#define RCU_EPOCH_INC		2
+#define RCU_ACTIVE		1
+
+struct rcu_thread {
+	u64 epoch;
+	u32 nesting;
+	bool in_use;
+
+	struct rcu_thread *next;
+} __attribute__((aligned(RCU_CACHELINE_SZ)));
+
+/* Read by every reader, keep it away from anything the writers touch */
+static u64 rcu_epoch __attribute__((aligned(RCU_CACHELINE_SZ)));
+
+static struct {
+	pthread_mutex_t lock;
+	struct rcu_thread *threads;
+	struct rcu_head *limbo[RCU_NR_LIMBO];
+	/* Number of threads currently running callbacks */
+	u32 nr_running;
+
+	pthread_once_t once;
+	pthread_key_t key;
+} rcu __attribute__((aligned(RCU_CACHELINE_SZ))) = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.once = PTHREAD_ONCE_INIT,
+};
+
+static __thread struct rcu_thread *rcu_self;
+
+static void rcu_thread_exit(void *arg)
+{
+	struct rcu_thread *t = arg;
+
+	pthread_mutex_lock(&rcu.lock);
+	t->nesting = 0;
+	__atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+	t->in_use = false;
+	pthread_mutex_unlock(&rcu.lock);
+}
+
+static void rcu_init_key(void)
+{
+	pthread_key_create(&rcu.key, rcu_thread_exit);
+}
+
+static struct rcu_thread *rcu_thread_register(void)
+{
+	struct rcu_thread *t;
+
+	pthread_once(&rcu.once, rcu_init_key);
+
+	pthread_mutex_lock(&rcu.lock);
+	for (t = rcu.threads; t; t = t->next) {
+		if (!t->in_use)
+			break;
+	}
+	if (!t) {
+		t = aligned_alloc(RCU_CACHELINE_SZ, sizeof(struct rcu_thread));
+		/*
+		 * ac_rcu_read_lock() has no way to fail and carrying on
+		 * unregistered would let things be free'd from under the
+		 * reader.
+		 */
+		if (!t) {
+			fputs("libac: rcu: out of memory registering thread\n",
+			      stderr);
+			abort();
+		}
+		memset(t, 0, sizeof(struct rcu_thread));
+		t->next = rcu.threads;
+		rcu.threads = t;
+	}
+	t->in_use = true;
+	pthread_mutex_unlock(&rcu.lock);
+
+	pthread_setspecific(rcu.key, t);
+	rcu_self = t;
+
+	return t;
+}
+
+/*
+ * Try and move the global epoch on, called with rcu.lock held.
+ *
+ * Returns the list of objects that are now safe to free, if any.
+ */
+static struct rcu_head *rcu_try_advance(void)
+{
+	const struct rcu_thread *t;
+	struct rcu_head *list;
+	u64 epoch = rcu_epoch;
+	int idx;
+
+	/* Order the writers unlinking before checking on the readers */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (t = rcu.threads; t; t = t->next) {
+		u64 e = __atomic_load_n(&t->epoch, __ATOMIC_ACQUIRE);
+
+		if (e && e != (epoch | RCU_ACTIVE))
+			return NULL;
+	}
+
+	epoch += RCU_EPOCH_INC;
+	__atomic_store_n(&rcu_epoch, epoch, __ATOMIC_RELEASE);
+
+	/* The list from two epochs ago, which is the next one to be used */
+	idx = (epoch / RCU_EPOCH_INC + 1) % RCU_NR_LIMBO;
+	list = rcu.limbo[idx];
+	rcu.limbo[idx] = NULL;
+
+	return list;
+}
+
+static void rcu_run_callbacks(struct rcu_head *list)
+{
+	while (list) {
+		struct rcu_head *next = list->next;
+
+		list->func(list);
+		list = next;
+	}
+}
+
+/*
+ * Queue an object that has been unlinked from a data structure to be
+ * free'd (by calling func) once no reader can be looking at it.
+ *
+ * This never runs any callbacks itself, so it can be called with locks
+ * held that the callbacks may need.
+ */
+void rcu_retire(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+	int idx;
+
+	head->func = func;
+
+	pthread_mutex_lock(&rcu.lock);
+	idx = (rcu_epoch / RCU_EPOCH_INC) % RCU_NR_LIMBO;
+	head->next = rcu.limbo[idx];
+	rcu.limbo[idx] = head;
+	pthread_mutex_unlock(&rcu.lock);
+}
+
+/*
+ * Try and move the epoch on and free anything that is now safe to free.
+ *
+ * This doesn't wait for readers. It tries to advance twice so that with
+ * no active readers, everything retired up to now is free'd straight away.
+ */
+void rcu_reclaim(void)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct rcu_head *list;
+
+		pthread_mutex_lock(&rcu.lock);
+		list = rcu_try_advance();
+		if (list)
+			rcu.nr_running++;
+		pthread_mutex_unlock(&rcu.lock);
+
+		if (!list)
+			break;
+		rcu_run_callbacks(list);
+
+		pthread_mutex_lock(&rcu.lock);
+		rcu.nr_running--;
+		pthread_mutex_unlock(&rcu.lock);
+	}
+}
+
+/**
+ * ac_rcu_read_lock - enter an RCU read-side critical section
+ *
+ * While in a read-side critical section, anything looked up in an RCU
+ * protected data structure (e.g ac_htable_rcu_t) will not be free'd.
+ *
+ * This takes no locks and does no atomic read-modify-write operations.
+ * Read-side critical sections may be nested.
+ */
+void ac_rcu_read_lock(void)
+{
+	struct rcu_thread *t = rcu_self;
+
+	if (!t)
+		t = rcu_thread_register();
+
+	if (t->nesting++ > 0)
+		return;
+
+	__atomic_store_n(&t->epoch,
+			 __atomic_load_n(&rcu_epoch, __ATOMIC_RELAXED) |
+			 RCU_ACTIVE, __ATOMIC_RELAXED);
+	/* Make the above visible before we start reading anything */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * ac_rcu_read_unlock - leave an RCU read-side critical section
+ *
+ * An unlock without a matching ac_rcu_read_lock() is ignored.
+ */
+void ac_rcu_read_unlock(void)
+{
+	struct rcu_thread *t = rcu_self;
+
+	if (!t || t->nesting == 0)
+		return;
+
+	if (--t->nesting > 0)
+		return;
+
+	__atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * ac_rcu_barrier - wait for all currently deferred frees to complete
+ *
+ * Waits until every reader that might be looking at something retired
+ * before this call has left its read-side critical section and then runs
+ * all the pending free's. Also waits for any free's being run by other
+ * threads to complete.
+ *
+ * Must not be called from within a read-side critical section.
+ */
+void ac_rcu_barrier(void)
+{
+	u64 target;
+
+	pthread_mutex_lock(&rcu.lock);
+	target = rcu_epoch + 2 * RCU_EPOCH_INC;
+	pthread_mutex_unlock(&rcu.lock);
+
+	for (;;) {
+		struct rcu_head *list;
+		u32 nr_running;
+		u64 epoch;
+
+		pthread_mutex_lock(&rcu.lock);
+		list = rcu_try_advance();
+		epoch = rcu_epoch;
+		/* Those being run by other threads */
+		nr_running = rcu.nr_running;
+		if (list)
+			rcu.nr_running++;
+		pthread_mutex_unlock(&rcu.lock);
+
+		if (list) {
+			rcu_run_callbacks(list);
+
+			pthread_mutex_lock(&rcu.lock);
+			rcu.nr_running--;
+			pthread_mutex_unlock(&rcu.lock);
+		}
+		if (epoch >= target && nr_running == 0)
+			break;
+		if (!list)
+			sched_yield();
+	}
+}
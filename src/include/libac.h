@@ -20,12 +20,13 @@
 #include <crypt.h>
 #endif
 #include <fcntl.h>
+#include <pthread.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define LIBAC_MAJOR_VERSION	 2
+#define LIBAC_MAJOR_VERSION	 3
 #define LIBAC_MINOR_VERSION	 0
 #define LIBAC_MICRO_VERSION	 0
 
@@ -128,28 +129,98 @@ typedef enum {
 	AC_SI_UNITS_YES
 } ac_si_units_t;
 
+typedef struct {
+	struct ac_arena_chunk *chunks;
+	struct ac_arena_chunk *cur;
+	size_t off;
+	size_t chunk_sz;
+} ac_arena_t;
+
+typedef enum {
+	AC_BTREE_TYPE_BINARY = 0,
+	AC_BTREE_TYPE_BPLUS
+} ac_btree_type_t;
+
 typedef struct ac_btree {
 	void *rootp;
 
 	int (*compar)(const void *, const void *);
 	void (*free_node)(void *nodep);
+
+	ac_btree_type_t type;
+	unsigned long count;
+
+	ac_arena_t *arena;
 } ac_btree_t;
 
+typedef struct {
+	struct ac_btree_rcu_node *head;
+	u8 level;
+	unsigned long count;
+	u64 seed;
+
+	pthread_mutex_t lock;
+
+	int (*compar)(const void *, const void *);
+	void (*free_node)(void *nodep);
+} ac_btree_rcu_t;
+
+typedef struct {
+	const ac_btree_t *tree;
+	const void *leaf;
+	u16 idx;
+} ac_btree_cursor_t;
+
+typedef struct {
+	ac_btree_cursor_t cur;
+	const void *hi;
+} ac_btree_range_t;
+
+#define AC_CIRC_BUF_CACHELINE_SZ	64
+
+typedef struct {
+	void *ptr;
+	u32 nr;
+} ac_circ_buf_span_t;
+
 typedef struct {
 	union {
 		void *cpy_buf;
 		void **ptr_buf;
 	} buf;
 
-	u32 head;
-	u32 tail;
-
 	u32 size;
 	u32 elem_sz;
 
 	int type;
+	u32 flags;
+
+	/* Where ac_circ_buf_pop() copies items to in SPSC copy buffers */
+	void *pop_item;
+
+	/* Written by the producer */
+	u64 head __attribute__((aligned(AC_CIRC_BUF_CACHELINE_SZ)));
+	u64 tail_cache;
+
+	/* Written by the consumer */
+	u64 tail __attribute__((aligned(AC_CIRC_BUF_CACHELINE_SZ)));
+	u64 head_cache;
 } ac_circ_buf_t;
 
+typedef struct {
+	void *slots;
+
+	u32 size;
+	u32 elem_sz;
+	u32 slot_sz;
+
+	int type;
+
+	/* The next positions to push to and pop from */
+	u64 head __attribute__((aligned(AC_CIRC_BUF_CACHELINE_SZ)));
+	u64 tail __attribute__((aligned(AC_CIRC_BUF_CACHELINE_SZ)));
+} ac_circ_buf_mpmc_t;
+
 typedef struct {
 	ac_geo_ellipsoid_t ref;
 	double lat;
@@ -167,15 +238,92 @@ typedef struct {
 } ac_geo_dms_t;
 
 typedef struct {
-	struct ac_slist **buckets;
+	struct ac_htable_entry *entries;
 	unsigned long count;
 
 	u32 (*hash_func)(const void *key);
+	u64 (*hash_func64)(const void *key);
 	int (*key_cmp)(const void *a, const void *b);
 	void (*free_key_func)(void *ptr);
 	void (*free_data_func)(void *ptr);
+
+	u32 size;
+	u32 min_size;
+	u32 grow_at;
+	u32 shrink_at;
+	u32 gen;
+	float max_load;
+	u8 shift;
+
+	/* Incremental resizing, see ac_htable_set_rehash_step() */
+	struct ac_htable_entry *old_entries;
+	u32 old_size;
+	u32 rehash_idx;
+	u32 rehash_step;
+	u8 old_shift;
+
+	u64 nr_hits;
+	u64 nr_misses;
 } ac_htable_t;
 
+typedef struct {
+	size_t bytes;
+	unsigned long count;
+	u64 size;
+	double load;
+	u32 max_probe;
+	double avg_probe;
+
+	u64 nr_hits;
+	u64 nr_misses;
+} ac_htable_stats_t;
+
+typedef struct {
+	ac_htable_t *htable;
+	u32 gen;
+	u32 start;
+	u32 offset;
+	u32 slot;
+	bool can_remove;
+} ac_htable_iter_t;
+
+typedef struct {
+	struct ac_htable_shard *shards;
+	u32 nr_shards;
+
+	u32 (*hash_func)(const void *key);
+} ac_htable_concurrent_t;
+
+typedef struct {
+	struct ac_htable_rcu_tbl *tbl;
+	unsigned long count;
+
+	/* Node pool, given back by ac_htable_rcu_destroy() */
+	struct ac_htable_rcu_chunk *chunks;
+	struct ac_htable_rcu_node *free_nodes;
+	struct ac_htable_rcu_node *freed_nodes;
+
+	pthread_mutex_t lock;
+
+	u32 (*hash_func)(const void *key);
+	int (*key_cmp)(const void *a, const void *b);
+	void (*free_key_func)(void *ptr);
+	void (*free_data_func)(void *ptr);
+} ac_htable_rcu_t;
+
+typedef struct {
+	const void *map;
+	size_t len;
+	const struct ac_htable_img_slot *slots;
+
+	u64 seed;
+	unsigned long count;
+	u32 size;
+	u32 key_sz;
+	u32 data_sz;
+	u8 shift;
+} ac_htable_img_t;
+
 typedef struct {
 	char *str;
 	size_t len;
@@ -225,8 +373,22 @@ typedef struct ac_slist {
 } ac_slist_t;
 
 #pragma GCC visibility push(default)
+extern ac_arena_t *ac_arena_new(size_t chunk_sz);
+extern void *ac_arena_alloc(ac_arena_t *arena, size_t size);
+extern void *ac_arena_aligned_alloc(ac_arena_t *arena, size_t alignment,
+				    size_t size);
+extern void ac_arena_reset(ac_arena_t *arena);
+extern void ac_arena_destroy(ac_arena_t *arena);
+
 extern void *ac_btree_new(int (*compar)(const void *, const void *),
 			  void (*free_node)(void *nodep));
+extern ac_btree_t *ac_btree_new_bplus(int (*compar)(const void *,
+						     const void *),
+				      void (*free_node)(void *nodep));
+extern ac_btree_t *ac_btree_new_arena(int (*compar)(const void *,
+						     const void *),
+				      void (*free_node)(void *nodep),
+				      ac_arena_t *arena);
 extern void ac_btree_foreach(const ac_btree_t *tree,
 			     void (*action)(const void *nodep, VISIT which,
 					    int depth));
@@ -237,14 +399,52 @@ extern void ac_btree_foreach_data(const ac_btree_t *tree,
 extern void *ac_btree_lookup(const ac_btree_t *tree, const void *key);
 extern void *ac_btree_add(ac_btree_t *tree, const void *key);
 extern void *ac_btree_remove(ac_btree_t *tree, const void *key);
+extern void *ac_btree_steal(ac_btree_t *tree, const void *key);
+extern int ac_btree_build_sorted(ac_btree_t *tree, void * const *nodes,
+				 size_t nr);
 extern void ac_btree_destroy(const ac_btree_t *tree);
 extern bool ac_btree_is_empty(const ac_btree_t *tree);
+extern unsigned long ac_btree_count(const ac_btree_t *tree);
+extern long ac_btree_rank(const ac_btree_t *tree, const void *key);
+extern void *ac_btree_select(const ac_btree_t *tree, unsigned long n);
+extern void *ac_btree_first(const ac_btree_t *tree, ac_btree_cursor_t *cur);
+extern void *ac_btree_last(const ac_btree_t *tree, ac_btree_cursor_t *cur);
+extern void *ac_btree_lower_bound(const ac_btree_t *tree, const void *key,
+				  ac_btree_cursor_t *cur);
+extern void *ac_btree_upper_bound(const ac_btree_t *tree, const void *key,
+				  ac_btree_cursor_t *cur);
+extern void *ac_btree_next(ac_btree_cursor_t *cur);
+extern void *ac_btree_prev(ac_btree_cursor_t *cur);
+extern void ac_btree_range_init(ac_btree_range_t *range,
+				const ac_btree_t *tree, const void *lo,
+				const void *hi);
+extern void *ac_btree_range_next(ac_btree_range_t *range);
+extern ac_btree_rcu_t *ac_btree_rcu_new(int (*compar)(const void *,
+						       const void *),
+					void (*free_node)(void *nodep));
+extern void *ac_btree_rcu_add(ac_btree_rcu_t *tree, void *node);
+extern bool ac_btree_rcu_remove(ac_btree_rcu_t *tree, const void *key);
+extern void *ac_btree_rcu_lookup(const ac_btree_rcu_t *tree,
+				 const void *key);
+extern void ac_btree_rcu_range(const ac_btree_rcu_t *tree, const void *lo,
+			       const void *hi,
+			       void (*action)(void *node, void *user_data),
+			       void *user_data);
+extern unsigned long ac_btree_rcu_count(const ac_btree_rcu_t *tree);
+extern void ac_btree_rcu_destroy(const ac_btree_rcu_t *tree);
 
 extern ac_circ_buf_t *ac_circ_buf_new(u32 size, u32 elem_sz);
+extern ac_circ_buf_t *ac_circ_buf_new_spsc(u32 size, u32 elem_sz);
+extern ac_circ_buf_t *ac_circ_buf_new_mirrored(u32 size, u32 elem_sz);
 extern u32 ac_circ_buf_count(const ac_circ_buf_t *cbuf);
 extern int ac_circ_buf_pushm(ac_circ_buf_t *cbuf, const void *buf,
 			     u32 count);
 extern int ac_circ_buf_push(ac_circ_buf_t *cbuf, const void *buf);
+extern int ac_circ_buf_reserve(ac_circ_buf_t *cbuf, u32 count,
+			       ac_circ_buf_span_t *span);
+extern void ac_circ_buf_commit(ac_circ_buf_t *cbuf, u32 count);
+extern u32 ac_circ_buf_peek(ac_circ_buf_t *cbuf, ac_circ_buf_span_t *span);
+extern void ac_circ_buf_consume(ac_circ_buf_t *cbuf, u32 count);
 extern int ac_circ_buf_popm(ac_circ_buf_t *cbuf, void *buf, u32 count);
 extern void *ac_circ_buf_pop(ac_circ_buf_t *cbuf);
 extern void ac_circ_buf_foreach(const ac_circ_buf_t *cbuf,
@@ -252,6 +452,11 @@ extern void ac_circ_buf_foreach(const ac_circ_buf_t *cbuf,
 				void *user_data);
 extern void ac_circ_buf_reset(ac_circ_buf_t *cbuf);
 extern void ac_circ_buf_destroy(const ac_circ_buf_t *cbuf);
+extern ac_circ_buf_mpmc_t *ac_circ_buf_mpmc_new(u32 size, u32 elem_sz);
+extern int ac_circ_buf_mpmc_push(ac_circ_buf_mpmc_t *cbuf, const void *buf);
+extern int ac_circ_buf_mpmc_pop(ac_circ_buf_mpmc_t *cbuf, void *buf);
+extern u32 ac_circ_buf_mpmc_count(const ac_circ_buf_mpmc_t *cbuf);
+extern void ac_circ_buf_mpmc_destroy(const ac_circ_buf_mpmc_t *cbuf);
 
 extern bool ac_fs_is_posix_name(const char *name);
 extern int ac_fs_mkdir_p(int dirfd, const char *path, mode_t mode);
@@ -269,14 +474,91 @@ extern ac_htable_t *ac_htable_new(u32 (*hash_func)(const void *key),
 				  int (*key_cmp)(const void *a, const void *b),
 				  void (*free_key_func)(void *key),
 				  void (*free_data_func)(void *data));
+extern ac_htable_t *ac_htable_new64(u64 (*hash_func)(const void *key),
+				    int (*key_cmp)(const void *a,
+						   const void *b),
+				    void (*free_key_func)(void *key),
+				    void (*free_data_func)(void *data));
+extern ac_htable_t *ac_htable_new_sized(u64 nr_entries, float max_load,
+					u32 (*hash_func)(const void *key),
+					int (*key_cmp)(const void *a,
+						       const void *b),
+					void (*free_key_func)(void *key),
+					void (*free_data_func)(void *data));
+extern ac_htable_t *ac_htable_new64_sized(u64 nr_entries, float max_load,
+					  u64 (*hash_func)(const void *key),
+					  int (*key_cmp)(const void *a,
+							 const void *b),
+					  void (*free_key_func)(void *key),
+					  void (*free_data_func)(void *data));
+extern int ac_htable_reserve(ac_htable_t *htable, u64 nr_entries);
+extern void ac_htable_set_rehash_step(ac_htable_t *htable, u32 nr_slots);
 extern void ac_htable_insert(ac_htable_t *htable, void *key, void *data);
+extern void ac_htable_insert_many(ac_htable_t *htable, void * const *keys,
+				  void * const *data, size_t nr);
 extern bool ac_htable_remove(ac_htable_t *htable, const void *key);
 extern void *ac_htable_lookup(const ac_htable_t *htable, const void *key);
+extern void ac_htable_lookup_many(const ac_htable_t *htable,
+				  const void * const *keys, void **data,
+				  size_t nr);
 extern void ac_htable_foreach(const ac_htable_t *htable,
 			      void (*action)(void *key, void *value,
 					     void *user_data),
 			      void *user_data);
+extern void ac_htable_stats(const ac_htable_t *htable,
+			    ac_htable_stats_t *stats);
+extern void ac_htable_iter_init(ac_htable_iter_t *iter, ac_htable_t *htable);
+extern bool ac_htable_iter_next(ac_htable_iter_t *iter, void **key,
+				void **data);
+extern bool ac_htable_iter_remove(ac_htable_iter_t *iter);
 extern void ac_htable_destroy(const ac_htable_t *htable);
+extern ac_htable_concurrent_t *ac_htable_concurrent_new(
+				u32 nr_shards,
+				u32 (*hash_func)(const void *key),
+				int (*key_cmp)(const void *a, const void *b),
+				void (*free_key_func)(void *key),
+				void (*free_data_func)(void *data));
+extern void ac_htable_concurrent_insert(ac_htable_concurrent_t *chtable,
+					void *key, void *data);
+extern bool ac_htable_concurrent_remove(ac_htable_concurrent_t *chtable,
+					const void *key);
+extern void *ac_htable_concurrent_lookup(
+				const ac_htable_concurrent_t *chtable,
+				const void *key);
+extern void ac_htable_concurrent_foreach(
+				const ac_htable_concurrent_t *chtable,
+				void (*action)(void *key, void *value,
+					       void *user_data),
+				void *user_data);
+extern unsigned long ac_htable_concurrent_count(
+				const ac_htable_concurrent_t *chtable);
+extern void ac_htable_concurrent_stats(
+				const ac_htable_concurrent_t *chtable,
+				ac_htable_stats_t *stats);
+extern void ac_htable_concurrent_destroy(
+				const ac_htable_concurrent_t *chtable);
+extern ac_htable_rcu_t *ac_htable_rcu_new(u32 (*hash_func)(const void *key),
+					  int (*key_cmp)(const void *a,
+							 const void *b),
+					  void (*free_key_func)(void *key),
+					  void (*free_data_func)(void *data));
+extern void ac_htable_rcu_insert(ac_htable_rcu_t *htable, void *key,
+				 void *data);
+extern bool ac_htable_rcu_remove(ac_htable_rcu_t *htable, const void *key);
+extern void *ac_htable_rcu_lookup(const ac_htable_rcu_t *htable,
+				  const void *key);
+extern void ac_htable_rcu_foreach(const ac_htable_rcu_t *htable,
+				  void (*action)(void *key, void *value,
+						 void *user_data),
+				  void *user_data);
+extern void ac_htable_rcu_destroy(const ac_htable_rcu_t *htable);
+
+extern int ac_htable_save(const ac_htable_t *htable, const char *path,
+			  u32 key_sz, u32 data_sz);
+extern ac_htable_img_t *ac_htable_img_open(const char *path);
+extern const void *ac_htable_img_lookup(const ac_htable_img_t *img,
+					const void *key);
+extern void ac_htable_img_close(ac_htable_img_t *img);
 
 extern char *ac_json_load_from_fd(int fd, off_t offset);
 extern char *ac_json_load_from_file(const char *file, off_t offset);
@@ -334,9 +616,18 @@ extern const char *ac_misc_gen_uuid4(char *dst);
 extern int ac_misc_shuffle(void *base, size_t nmemb, size_t size,
 			   ac_misc_shuffle_t algo);
 extern bool ac_misc_luhn_check(u64 num);
+extern void ac_hash_set_seed(u64 seed);
+extern int ac_hash_set_random_seed(void);
+extern u64 ac_hash_buf(const void *buf, size_t len);
+extern u64 ac_hash_buf_seed(const void *buf, size_t len, u64 seed);
 extern u32 ac_hash_func_ptr(const void *key);
 extern u32 ac_hash_func_str(const void *key);
 extern u32 ac_hash_func_u32(const void *key);
+extern u32 ac_hash_func_u64(const void *key);
+extern u64 ac_hash64_func_ptr(const void *key);
+extern u64 ac_hash64_func_str(const void *key);
+extern u64 ac_hash64_func_u32(const void *key);
+extern u64 ac_hash64_func_u64(const void *key);
 extern int ac_cmp_ptr(const void *a, const void *b);
 extern int ac_cmp_str(const void *a, const void *b);
 extern int ac_cmp_u32(const void *a, const void *b);
@@ -377,6 +668,10 @@ extern void ac_queue_foreach(const ac_queue_t *queue,
 extern void ac_queue_destroy(const ac_queue_t *queue,
 			     void (*free_func)(void *item));
 
+extern void ac_rcu_read_lock(void);
+extern void ac_rcu_read_unlock(void);
+extern void ac_rcu_barrier(void);
+
 extern ac_slist_t *ac_slist_last(ac_slist_t *list);
 extern long ac_slist_len(const ac_slist_t *list);
 extern void ac_slist_add(ac_slist_t **list, void *data);
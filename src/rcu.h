@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: LGPL-2.1 */
+
+/*
+ * rcu.h - Internal epoch based deferred reclamation interface
+ *
+ * Copyright (c) 2026	Andrew Clayton <ac@sigsegv.uk>
+ */
+
+#ifndef _RCU_H_
+#define _RCU_H_
+
+#include <stddef.h>
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+};
+
+extern void rcu_retire(struct rcu_head *head,
+		       void (*func)(struct rcu_head *head));
+extern void rcu_reclaim(void);
+
+#endif /* _RCU_H_ */
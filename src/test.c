@@ -11,12 +11,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <search.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "include/libac.h"
 
@@ -70,9 +74,273 @@ static int compare(const void *pa, const void *pb)
 		return 0;
 }
 
+static void count_node(const void *data, VISIT which __always_unused,
+		       void *user_data)
+{
+	const struct tnode *tn = *(struct tnode **)data;
+	int *last = user_data;
+
+	/* Check we're being called in order */
+	if (tn->key > last[0])
+		last[1]++;
+	last[0] = tn->key;
+}
+
+static void arena_test(void)
+{
+	ac_arena_t *arena;
+	ac_btree_t *tree;
+	struct tnode stn;
+	char *big;
+	void *p;
+	int i;
+
+	printf("*** %s\n", __func__);
+
+	arena = ac_arena_new(4096);
+	p = ac_arena_alloc(arena, 1);
+	printf("alloc: 16 byte aligned -> %s, ",
+	       (uintptr_t)ac_arena_alloc(arena, 8) % 16 == 0 ? "yes" : "no");
+	printf("64 byte aligned -> %s\n",
+	       (uintptr_t)ac_arena_aligned_alloc(arena, 64, 8) % 64 == 0 ?
+	       "yes" : "no");
+	big = ac_arena_alloc(arena, 100000);
+	memset(big, 0, 100000);
+	ac_arena_reset(arena);
+	printf("after reset, first alloc is %sreused\n",
+	       ac_arena_alloc(arena, 1) == p ? "" : "not ");
+	errno = 0;
+	p = ac_arena_alloc(arena, SIZE_MAX);
+	printf("alloc SIZE_MAX -> %s (%s)\n", p ? "ptr" : "NULL",
+	       strerror(errno));
+
+	for (i = 0; i < 3; i++) {
+		int j;
+
+		ac_arena_reset(arena);
+		tree = ac_btree_new_arena(compare, NULL, arena);
+		for (j = 0; j < 100000; j++) {
+			struct tnode *tn = ac_arena_alloc(arena,
+						sizeof(struct tnode));
+
+			tn->key = (j * 7919) % 100000;
+			tn->data = NULL;
+			ac_btree_add(tree, tn);
+		}
+		for (j = 0; j < 100000; j += 2) {
+			stn.key = j;
+			ac_btree_remove(tree, &stn);
+		}
+		stn.key = 4001;
+		printf("arena tree %d: count %lu, rank: 4001 -> %ld\n", i,
+		       ac_btree_count(tree), ac_btree_rank(tree, &stn));
+		ac_btree_destroy(tree);
+	}
+	ac_arena_destroy(arena);
+
+	printf("*** %s\n\n", __func__);
+}
+
+static void btree_bplus_test(void)
+{
+	ac_btree_t *tree;
+	ac_btree_cursor_t cur;
+	ac_btree_range_t range;
+	struct tnode *tn;
+	struct tnode stn;
+	struct tnode hi;
+	void **nodes;
+	int last[2] = { -1, 0 };
+	int i;
+
+	printf("New B+tree with 100000 nodes\n");
+	tree = ac_btree_new_bplus(compare, free_tnode);
+	for (i = 100000; i > 0; i--) {
+		tn = malloc(sizeof(struct tnode));
+		tn->key = (i * 7919) % 100000;
+		tn->data = NULL;
+		ac_btree_add(tree, tn);
+	}
+	for (i = 0; i < 100000; i++) {
+		stn.key = i;
+		tn = ac_btree_lookup(tree, &stn);
+		if (!tn || tn->key != i)
+			break;
+	}
+	printf("lookup: %s\n", i == 100000 ? "all found" : "missing nodes");
+
+	printf("Removing the odd nodes\n");
+	for (i = 1; i < 100000; i += 2) {
+		stn.key = i;
+		ac_btree_remove(tree, &stn);
+	}
+	ac_btree_foreach_data(tree, count_node, last);
+	printf("%d nodes visited in order, count %lu\n", last[1],
+	       ac_btree_count(tree));
+	stn.key = 1001;
+	tn = ac_btree_select(tree, 25000);
+	printf("rank: 1001 -> %ld, select: 25000 -> %d\n",
+	       ac_btree_rank(tree, &stn), tn->key);
+	stn.key = 3;
+	printf("lookup: 3 -> %p\n", ac_btree_lookup(tree, &stn));
+
+	tn = ac_btree_first(tree, &cur);
+	printf("first: %d, ", tn->key);
+	tn = ac_btree_last(tree, &cur);
+	printf("last: %d, ", tn->key);
+	tn = ac_btree_prev(&cur);
+	printf("prev: %d\n", tn->key);
+	tn = ac_btree_lower_bound(tree, &stn, &cur);
+	printf("lower_bound: 3 -> %d, ", tn->key);
+	stn.key = 4;
+	tn = ac_btree_lower_bound(tree, &stn, &cur);
+	printf("4 -> %d, ", tn->key);
+	tn = ac_btree_upper_bound(tree, &stn, &cur);
+	printf("upper_bound: 4 -> %d, ", tn->key);
+	tn = ac_btree_next(&cur);
+	printf("next: %d\n", tn->key);
+
+	stn.key = 95;
+	hi.key = 104;
+	printf("range [95, 104) :");
+	ac_btree_range_init(&range, tree, &stn, &hi);
+	while ((tn = ac_btree_range_next(&range)) != NULL)
+		printf(" %d", tn->key);
+	printf("\n");
+
+	for (i = 0; i < 100000; i += 2) {
+		stn.key = i;
+		ac_btree_remove(tree, &stn);
+	}
+	printf("tree is %sempty\n", ac_btree_is_empty(tree) ? "" : "not ");
+	ac_btree_destroy(tree);
+
+	printf("New B+tree built from 100000 sorted nodes\n");
+	tree = ac_btree_new_bplus(compare, free_tnode);
+	nodes = malloc(sizeof(void *) * 100000);
+	for (i = 0; i < 100000; i++) {
+		tn = malloc(sizeof(struct tnode));
+		tn->key = i * 2;
+		tn->data = NULL;
+		nodes[i] = tn;
+	}
+	printf("ac_btree_build_sorted() -> %d, ",
+	       ac_btree_build_sorted(tree, nodes, 100000));
+	printf("again -> %d\n", ac_btree_build_sorted(tree, nodes, 100000));
+	free(nodes);
+	stn.key = 1001;
+	tn = ac_btree_select(tree, 99999);
+	printf("count %lu, rank: 1001 -> %ld, select: 99999 -> %d\n",
+	       ac_btree_count(tree), ac_btree_rank(tree, &stn), tn->key);
+	tn = malloc(sizeof(struct tnode));
+	tn->key = 1001;
+	tn->data = NULL;
+	ac_btree_add(tree, tn);
+	stn.key = 1000;
+	ac_btree_remove(tree, &stn);
+	stn.key = 998;
+	ac_btree_range_init(&range, tree, &stn, NULL);
+	tn = ac_btree_range_next(&range);
+	printf("after add 1001/remove 1000 : %d", tn->key);
+	tn = ac_btree_range_next(&range);
+	printf(" %d\n", tn->key);
+	ac_btree_destroy(tree);
+}
+
+#define BTREE_RCU_NR_READERS	3
+#define BTREE_RCU_NR_UPDATES	20000
+
+static bool btree_rcu_stop;
+
+static void btree_rcu_check_node(void *node, void *user_data)
+{
+	const struct tnode *tn = node;
+	int *last = user_data;
+
+	/* Keys must come in order and no even key may be missing */
+	if (tn->key <= last[0] || tn->key > last[0] + 2 ||
+	    (tn->key > last[0] + 1 && (last[0] & 1)))
+		last[1]++;
+	last[0] = tn->key;
+}
+
+static void *btree_rcu_reader(void *arg)
+{
+	const ac_btree_rcu_t *tree = arg;
+	long bad = 0;
+	int i = 0;
+
+	while (!__atomic_load_n(&btree_rcu_stop, __ATOMIC_ACQUIRE)) {
+		struct tnode stn;
+		struct tnode hi;
+		int last[2];
+
+		stn.key = (i++ % 500) * 2;
+		if (!ac_btree_rcu_lookup(tree, &stn))
+			bad++;
+
+		hi.key = stn.key + 20;
+		last[0] = stn.key - 2;
+		last[1] = 0;
+		ac_btree_rcu_range(tree, &stn, &hi, btree_rcu_check_node, last);
+		bad += last[1];
+	}
+
+	return AC_LONG_TO_PTR(bad);
+}
+
+static void btree_rcu_test(void)
+{
+	ac_btree_rcu_t *tree;
+	pthread_t tids[BTREE_RCU_NR_READERS];
+	struct tnode stn;
+	long bad = 0;
+	long i;
+
+	printf("New RCU tree, %d readers\n", BTREE_RCU_NR_READERS);
+	tree = ac_btree_rcu_new(compare, free_tnode);
+	/* The even keys stay put, the odd ones come and go */
+	for (i = 0; i < 1000; i += 2) {
+		struct tnode *tn = malloc(sizeof(struct tnode));
+
+		tn->key = i;
+		tn->data = NULL;
+		ac_btree_rcu_add(tree, tn);
+	}
+	for (i = 0; i < BTREE_RCU_NR_READERS; i++)
+		pthread_create(&tids[i], NULL, btree_rcu_reader, tree);
+	for (i = 0; i < BTREE_RCU_NR_UPDATES; i++) {
+		struct tnode *tn = malloc(sizeof(struct tnode));
+
+		tn->key = (i * 7 % 500) * 2 + 1;
+		tn->data = NULL;
+		if (ac_btree_rcu_add(tree, tn) != tn) {
+			ac_btree_rcu_remove(tree, tn);
+			free(tn);
+		}
+	}
+	__atomic_store_n(&btree_rcu_stop, true, __ATOMIC_RELEASE);
+	for (i = 0; i < BTREE_RCU_NR_READERS; i++) {
+		void *ret;
+
+		pthread_join(tids[i], &ret);
+		bad += AC_PTR_TO_LONG(ret);
+	}
+	printf("Bad lookups : %ld\n", bad);
+	stn.key = 998;
+	printf("lookup: 998 -> %s, ",
+	       ac_btree_rcu_lookup(tree, &stn) ? "found" : "not found");
+	stn.key = 999;
+	printf("999 -> %s\n",
+	       ac_btree_rcu_lookup(tree, &stn) ? "found" : "not found");
+	printf("There are %lu node(s) in the tree\n", ac_btree_rcu_count(tree));
+	ac_btree_rcu_destroy(tree);
+}
+
 static void btree_test(void)
 {
 	ac_btree_t *tree;
+	ac_btree_t *tree2;
 	struct tnode *tn;
 	struct tnode stn;
 
@@ -102,9 +370,25 @@ static void btree_test(void)
 	printf("Found tnode: %d - %s\n", tn->key, (char *)tn->data);
 
 	ac_btree_foreach(tree, print_node);
+	printf("tree has %lu node(s)\n", ac_btree_count(tree));
 
 	ac_btree_remove(tree, &stn);
+
+	printf("Moving node 1 to a B+tree\n");
+	tree2 = ac_btree_new_bplus(compare, free_tnode);
+	stn.key = 1;
+	tn = ac_btree_steal(tree, &stn);
+	ac_btree_add(tree2, tn);
+	printf("trees have %lu & %lu node(s), steal again -> %p\n",
+	       ac_btree_count(tree), ac_btree_count(tree2),
+	       ac_btree_steal(tree, &stn));
+	tn = ac_btree_lookup(tree2, &stn);
+	printf("Found tnode: %d - %s\n", tn->key, (char *)tn->data);
 	ac_btree_destroy(tree);
+	ac_btree_destroy(tree2);
+
+	btree_bplus_test();
+	btree_rcu_test();
 
 	printf("*** %s\n\n", __func__);
 }
@@ -158,9 +442,128 @@ static void print_circ_buf_itemi(void *item, void *data __always_unused)
 	printf("\titem %d\n", *(int *)item);
 }
 
+#define CIRC_BUF_SPSC_NR_ITEMS	100000
+
+static void *circ_buf_spsc_producer(void *arg)
+{
+	ac_circ_buf_t *cbuf = arg;
+	long i;
+
+	for (i = 1; i <= CIRC_BUF_SPSC_NR_ITEMS; i++) {
+		if (cbuf->type == 0) {
+			while (ac_circ_buf_push(cbuf, AC_LONG_TO_PTR(i)) == -1)
+				sched_yield();
+		} else {
+			while (ac_circ_buf_push(cbuf, &i) == -1)
+				sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+static void circ_buf_spsc_test(u32 elem_sz)
+{
+	ac_circ_buf_t *cbuf;
+	pthread_t tid;
+	long bad = 0;
+	long i;
+
+	printf("ac_circ_buf_new_spsc() [%s], %d items\n",
+	       elem_sz ? "data copy" : "pointers", CIRC_BUF_SPSC_NR_ITEMS);
+	cbuf = ac_circ_buf_new_spsc(256, elem_sz);
+	pthread_create(&tid, NULL, circ_buf_spsc_producer, cbuf);
+	for (i = 1; i <= CIRC_BUF_SPSC_NR_ITEMS; i++) {
+		void *item;
+
+		while ((item = ac_circ_buf_pop(cbuf)) == NULL)
+			sched_yield();
+		if ((elem_sz ? *(long *)item : AC_PTR_TO_LONG(item)) != i)
+			bad++;
+	}
+	pthread_join(tid, NULL);
+	printf("Out of order items : %ld, nr : %u\n", bad,
+	       ac_circ_buf_count(cbuf));
+	ac_circ_buf_destroy(cbuf);
+}
+
+#define CIRC_BUF_MPMC_NR_THREADS	2
+#define CIRC_BUF_MPMC_NR_ITEMS		50000
+
+static long circ_buf_mpmc_popped;
+
+static void *circ_buf_mpmc_producer(void *arg)
+{
+	ac_circ_buf_mpmc_t *cbuf = arg;
+	long i;
+
+	for (i = 1; i <= CIRC_BUF_MPMC_NR_ITEMS; i++) {
+		const void *item = cbuf->type == 0 ? AC_LONG_TO_PTR(i) : &i;
+
+		while (ac_circ_buf_mpmc_push(cbuf, item) == -1)
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+static void *circ_buf_mpmc_consumer(void *arg)
+{
+	ac_circ_buf_mpmc_t *cbuf = arg;
+	long sum = 0;
+
+	while (__atomic_load_n(&circ_buf_mpmc_popped, __ATOMIC_RELAXED) <
+	       CIRC_BUF_MPMC_NR_THREADS * CIRC_BUF_MPMC_NR_ITEMS) {
+		long item;
+
+		/* A pointer and a long are the same size here */
+		if (ac_circ_buf_mpmc_pop(cbuf, &item) == -1) {
+			sched_yield();
+			continue;
+		}
+		sum += item;
+		__atomic_add_fetch(&circ_buf_mpmc_popped, 1, __ATOMIC_RELAXED);
+	}
+
+	return AC_LONG_TO_PTR(sum);
+}
+
+static void circ_buf_mpmc_test(u32 elem_sz)
+{
+	ac_circ_buf_mpmc_t *cbuf;
+	pthread_t producers[CIRC_BUF_MPMC_NR_THREADS];
+	pthread_t consumers[CIRC_BUF_MPMC_NR_THREADS];
+	long sum = 0;
+	int i;
+
+	printf("ac_circ_buf_mpmc_new() [%s], %d producers & consumers\n",
+	       elem_sz ? "data copy" : "pointers", CIRC_BUF_MPMC_NR_THREADS);
+	cbuf = ac_circ_buf_mpmc_new(64, elem_sz);
+	circ_buf_mpmc_popped = 0;
+	for (i = 0; i < CIRC_BUF_MPMC_NR_THREADS; i++) {
+		pthread_create(&producers[i], NULL, circ_buf_mpmc_producer,
+			       cbuf);
+		pthread_create(&consumers[i], NULL, circ_buf_mpmc_consumer,
+			       cbuf);
+	}
+	for (i = 0; i < CIRC_BUF_MPMC_NR_THREADS; i++) {
+		void *ret;
+
+		pthread_join(producers[i], NULL);
+		pthread_join(consumers[i], &ret);
+		sum += AC_PTR_TO_LONG(ret);
+	}
+	printf("Sum of popped items : %ld (expected %ld), nr : %u\n", sum,
+	       (long)CIRC_BUF_MPMC_NR_THREADS * CIRC_BUF_MPMC_NR_ITEMS *
+	       (CIRC_BUF_MPMC_NR_ITEMS + 1) / 2, ac_circ_buf_mpmc_count(cbuf));
+	ac_circ_buf_mpmc_destroy(cbuf);
+}
+
 static void circ_buf_test(void)
 {
 	ac_circ_buf_t *cbuf;
+	ac_circ_buf_span_t span[2];
+	u32 nr;
 	long buf[3];
 	void **sbuf;
 	int n[7] = { 1025, 23768, 3, 4, 5, 65539, -1 };
@@ -282,6 +685,73 @@ static void circ_buf_test(void)
 
 	ac_circ_buf_destroy(cbuf);
 
+	printf("ac_circ_buf_new() [wrapping]\n");
+	cbuf = ac_circ_buf_new(8, sizeof(int));
+	for (i = 0; i < 7; i++)
+		n[i] = i + 1;
+	ac_circ_buf_pushm(cbuf, n, 6);
+	ac_circ_buf_popm(cbuf, n, 5);
+	for (i = 0; i < 7; i++)
+		n[i] = (i + 1) * 10;
+	printf("ac_circ_buf_pushm() 6 items across the end -> %d\n",
+	       ac_circ_buf_pushm(cbuf, n, 6));
+	printf("ac_circ_buf_pushm() 2 items with room for 1 -> %d\n",
+	       ac_circ_buf_pushm(cbuf, n, 2));
+	memset(n, 0, sizeof(n));
+	printf("ac_circ_buf_popm() 7 items -> %d :", ac_circ_buf_popm(cbuf, n,
+								      7));
+	for (i = 0; i < 7; i++)
+		printf(" %d", n[i]);
+	printf("\n");
+
+	ac_circ_buf_reserve(cbuf, 5, span);
+	printf("ac_circ_buf_reserve() 5 items -> spans of %u & %u\n",
+	       span[0].nr, span[1].nr);
+	for (i = 0; i < (int)span[0].nr; i++)
+		((int *)span[0].ptr)[i] = 100 + i;
+	for (i = 0; i < (int)span[1].nr; i++)
+		((int *)span[1].ptr)[i] = 100 + span[0].nr + i;
+	ac_circ_buf_commit(cbuf, 5);
+	nr = ac_circ_buf_peek(cbuf, span);
+	printf("ac_circ_buf_peek() -> %u items :", nr);
+	for (i = 0; i < (int)span[0].nr; i++)
+		printf(" %d", ((int *)span[0].ptr)[i]);
+	for (i = 0; i < (int)span[1].nr; i++)
+		printf(" %d", ((int *)span[1].ptr)[i]);
+	printf("\n");
+	ac_circ_buf_consume(cbuf, nr);
+	printf("nr : %u\n", ac_circ_buf_count(cbuf));
+	ac_circ_buf_destroy(cbuf);
+
+	printf("ac_circ_buf_new_mirrored() [4096 bytes]\n");
+	cbuf = ac_circ_buf_new_mirrored(4096, 1);
+	sbuf = malloc(4090);
+	memset(sbuf, 'x', 4090);
+	ac_circ_buf_pushm(cbuf, sbuf, 4090);
+	ac_circ_buf_popm(cbuf, sbuf, 4090);
+	free(sbuf);
+	ac_circ_buf_reserve(cbuf, 12, span);
+	printf("ac_circ_buf_reserve() 12 bytes -> spans of %u & %u\n",
+	       span[0].nr, span[1].nr);
+	memcpy(span[0].ptr, "Hello World", 12);
+	ac_circ_buf_commit(cbuf, 12);
+	nr = ac_circ_buf_peek(cbuf, span);
+	printf("ac_circ_buf_peek() -> %u bytes : %s\n", nr,
+	       (char *)span[0].ptr);
+	ac_circ_buf_consume(cbuf, nr);
+	ac_circ_buf_destroy(cbuf);
+	/* A power of 2, but not a multiple of the page size */
+	cbuf = ac_circ_buf_new_mirrored(64, 1);
+	printf("ac_circ_buf_new_mirrored() [64 bytes] -> %s\n",
+	       cbuf ? "OK" : errno == EINVAL ? "EINVAL" : "error");
+	if (cbuf)
+		ac_circ_buf_destroy(cbuf);
+
+	circ_buf_spsc_test(0);
+	circ_buf_spsc_test(sizeof(long));
+	circ_buf_mpmc_test(0);
+	circ_buf_mpmc_test(sizeof(long));
+
 	printf("*** %s\n\n", __func__);
 }
 
@@ -368,16 +838,245 @@ static void geo_test(void)
 	printf("*** %s\n\n", __func__);
 }
 
+#define HTABLE_NR_THREADS	4
+#define HTABLE_THREAD_NR_KEYS	10000
+
+struct htable_thread_arg {
+	ac_htable_concurrent_t *chtable;
+	long base;
+};
+
+static void *htable_concurrent_thread(void *arg)
+{
+	const struct htable_thread_arg *ta = arg;
+	long i;
+	long found = 0;
+
+	for (i = 1; i <= HTABLE_THREAD_NR_KEYS; i++)
+		ac_htable_concurrent_insert(ta->chtable,
+					    AC_LONG_TO_PTR(ta->base + i),
+					    AC_LONG_TO_PTR(i));
+	for (i = 1; i <= HTABLE_THREAD_NR_KEYS; i++) {
+		void *data = ac_htable_concurrent_lookup(
+					ta->chtable,
+					AC_LONG_TO_PTR(ta->base + i));
+		if (data == AC_LONG_TO_PTR(i))
+			found++;
+	}
+	for (i = 1; i <= HTABLE_THREAD_NR_KEYS; i += 2)
+		ac_htable_concurrent_remove(ta->chtable,
+					    AC_LONG_TO_PTR(ta->base + i));
+
+	return AC_LONG_TO_PTR(found);
+}
+
+static void htable_concurrent_test(void)
+{
+	ac_htable_concurrent_t *chtable;
+	pthread_t tids[HTABLE_NR_THREADS];
+	struct htable_thread_arg args[HTABLE_NR_THREADS];
+	long found = 0;
+	int i;
+
+	printf("New concurrent hash table, %d threads\n", HTABLE_NR_THREADS);
+	chtable = ac_htable_concurrent_new(0, ac_hash_func_ptr, ac_cmp_ptr,
+					   NULL, NULL);
+	for (i = 0; i < HTABLE_NR_THREADS; i++) {
+		args[i].chtable = chtable;
+		args[i].base = (long)i * HTABLE_THREAD_NR_KEYS;
+		pthread_create(&tids[i], NULL, htable_concurrent_thread,
+			       &args[i]);
+	}
+	for (i = 0; i < HTABLE_NR_THREADS; i++) {
+		void *ret;
+
+		pthread_join(tids[i], &ret);
+		found += AC_PTR_TO_LONG(ret);
+	}
+	printf("lookup: found %ld of %d\n", found,
+	       HTABLE_NR_THREADS * HTABLE_THREAD_NR_KEYS);
+	printf("There are %lu item(s) in the hash table\n",
+	       ac_htable_concurrent_count(chtable));
+	printf("lookup: 2 -> %ld\n",
+	       AC_PTR_TO_LONG(ac_htable_concurrent_lookup(chtable,
+							  AC_LONG_TO_PTR(2))));
+	printf("Destoying hash table\n");
+	ac_htable_concurrent_destroy(chtable);
+}
+
+#define HTABLE_RCU_NR_READERS	3
+#define HTABLE_RCU_NR_UPDATES	20000
+
+static bool htable_rcu_stop;
+
+static void *htable_rcu_reader(void *arg)
+{
+	const ac_htable_rcu_t *htable = arg;
+	long bad = 0;
+
+	while (!__atomic_load_n(&htable_rcu_stop, __ATOMIC_ACQUIRE)) {
+		const char *data;
+
+		ac_rcu_read_lock();
+		data = ac_htable_rcu_lookup(htable, "config");
+		if (!data || strncmp(data, "value-", 6) != 0)
+			bad++;
+		ac_rcu_read_unlock();
+	}
+
+	return AC_LONG_TO_PTR(bad);
+}
+
+static void htable_rcu_test(void)
+{
+	ac_htable_rcu_t *htable;
+	pthread_t tids[HTABLE_RCU_NR_READERS];
+	long bad = 0;
+	long i;
+
+	/* An unbalanced unlock should be harmless */
+	ac_rcu_read_unlock();
+
+	printf("New RCU hash table, %d readers\n", HTABLE_RCU_NR_READERS);
+	htable = ac_htable_rcu_new(ac_hash_func_str, ac_cmp_str, free, free);
+	ac_htable_rcu_insert(htable, strdup("config"), strdup("value-0"));
+	for (i = 0; i < HTABLE_RCU_NR_READERS; i++)
+		pthread_create(&tids[i], NULL, htable_rcu_reader, htable);
+	for (i = 1; i <= HTABLE_RCU_NR_UPDATES; i++) {
+		char key[32];
+		char data[32];
+
+		snprintf(data, sizeof(data), "value-%ld", i);
+		ac_htable_rcu_insert(htable, strdup("config"), strdup(data));
+		snprintf(key, sizeof(key), "key-%ld", i % 1000);
+		if (i % 3)
+			ac_htable_rcu_insert(htable, strdup(key), strdup(data));
+		else
+			ac_htable_rcu_remove(htable, key);
+	}
+	__atomic_store_n(&htable_rcu_stop, true, __ATOMIC_RELEASE);
+	for (i = 0; i < HTABLE_RCU_NR_READERS; i++) {
+		void *ret;
+
+		pthread_join(tids[i], &ret);
+		bad += AC_PTR_TO_LONG(ret);
+	}
+	printf("Bad lookups : %ld\n", bad);
+	printf("lookup: config -> %s\n",
+	       (char *)ac_htable_rcu_lookup(htable, "config"));
+	printf("There are %lu item(s) in the hash table\n", htable->count);
+	printf("Destoying hash table\n");
+	ac_htable_rcu_destroy(htable);
+}
+
+static int htable_cmp_u64(const void *a, const void *b)
+{
+	return *(const u64 *)a != *(const u64 *)b;
+}
+
+static void htable_img_test(void)
+{
+	ac_htable_t *htable;
+	ac_htable_img_t *img;
+	u8 junk[1024];
+	u64 *keys;
+	u64 key;
+	long i;
+	int fd;
+
+	printf("Saving a hash table with string keys/data to an image\n");
+	htable = ac_htable_new(ac_hash_func_str, ac_cmp_str, NULL, NULL);
+	ac_htable_insert(htable, "::1", "localhost");
+	ac_htable_insert(htable, "fe80::/10", "link-local");
+	ac_htable_insert(htable, "ff00::/8", NULL);
+	ac_htable_save(htable, "/tmp/libac_htable.img", 0, 0);
+	ac_htable_destroy(htable);
+
+	img = ac_htable_img_open("/tmp/libac_htable.img");
+	printf("There are %lu item(s) in the image\n", img->count);
+	printf("lookup: ::1 -> %s\n",
+	       (const char *)ac_htable_img_lookup(img, "::1"));
+	printf("lookup: fe80::/10 -> %s\n",
+	       (const char *)ac_htable_img_lookup(img, "fe80::/10"));
+	printf("lookup: ff00::/8 -> %p\n", ac_htable_img_lookup(img, "ff00::/8"));
+	printf("lookup: fe80:: -> %p\n", ac_htable_img_lookup(img, "fe80::"));
+	ac_htable_img_close(img);
+
+	/* Overwrite everything past the header, lookups should just fail */
+	fd = open("/tmp/libac_htable.img", O_WRONLY);
+	memset(junk, 0xff, sizeof(junk));
+	if (pwrite(fd, junk, AC_MIN(lseek(fd, 0, SEEK_END) - 64,
+				    (off_t)sizeof(junk)), 64) == -1)
+		perror("pwrite");
+	close(fd);
+	img = ac_htable_img_open("/tmp/libac_htable.img");
+	printf("corrupt image: %s, lookup: ::1 -> %p\n",
+	       img ? "opened" : "rejected",
+	       img ? ac_htable_img_lookup(img, "::1") : NULL);
+	if (img)
+		ac_htable_img_close(img);
+
+	printf("Saving a hash table with 100000 u64 keys/data to an image\n");
+	keys = malloc(sizeof(u64) * 100000);
+	htable = ac_htable_new(ac_hash_func_u64, htable_cmp_u64, NULL, NULL);
+	for (i = 0; i < 100000; i++) {
+		keys[i] = i * 7;
+		ac_htable_insert(htable, &keys[i], &keys[i]);
+	}
+	ac_htable_save(htable, "/tmp/libac_htable.img", sizeof(u64),
+		       sizeof(u64));
+	ac_htable_destroy(htable);
+	free(keys);
+
+	img = ac_htable_img_open("/tmp/libac_htable.img");
+	for (i = 0; i < 100000; i++) {
+		const u64 *data;
+
+		key = i * 7;
+		data = ac_htable_img_lookup(img, &key);
+		if (!data || *data != key)
+			break;
+	}
+	key = 1;
+	printf("There are %lu item(s) in the image, lookup: %s, 1 -> %p\n",
+	       img->count, i == 100000 ? "all found" : "missing entries",
+	       ac_htable_img_lookup(img, &key));
+	ac_htable_img_close(img);
+	unlink("/tmp/libac_htable.img");
+}
+
 static void htable_print_entry(void *key, void *data,
 			       void *user_data __always_unused)
 {
 	printf("%s -> %s\n", (char *)key, (char *)data);
 }
 
+static void htable_count_entry(void *key __always_unused,
+			       void *data __always_unused, void *user_data)
+{
+	(*(long *)user_data)++;
+}
+
+static unsigned long htable_nr_cmps;
+
+static int htable_cmp_str(const void *a, const void *b)
+{
+	htable_nr_cmps++;
+
+	return ac_cmp_str(a, b);
+}
+
 static void htable_test(void)
 {
 	ac_htable_t *htable;
+	ac_htable_iter_t iter;
+	ac_htable_stats_t stats;
+	void **keys;
+	void **vals;
 	char *data;
+	long visited;
+	long i;
+	u32 size;
 
 	printf("*** %s\n", __func__);
 
@@ -422,6 +1121,183 @@ static void htable_test(void)
 	printf("Destoying hash table\n");
 	ac_htable_destroy(htable);
 
+	printf("New hash table with 100000 static int keys\n");
+	htable = ac_htable_new(ac_hash_func_ptr, ac_cmp_ptr, NULL, NULL);
+	for (i = 1; i <= 100000; i++)
+		ac_htable_insert(htable, AC_LONG_TO_PTR(i), AC_LONG_TO_PTR(i));
+	printf("There are %lu item(s) in the hash table (size %u)\n",
+	       htable->count, htable->size);
+	for (i = 1; i <= 100000; i++) {
+		if (ac_htable_lookup(htable, AC_LONG_TO_PTR(i)) !=
+		    AC_LONG_TO_PTR(i))
+			break;
+	}
+	printf("lookup: %s\n", i > 100000 ? "all found" : "missing entries");
+	ac_htable_stats(htable, &stats);
+	printf("stats: %zu bytes, load %.2f, max probe %u, avg probe %.2f, "
+	       "hits %" PRIu64 ", misses %" PRIu64 "\n", stats.bytes, stats.load,
+	       stats.max_probe, stats.avg_probe, stats.nr_hits,
+	       stats.nr_misses);
+	printf("Removing all but 10 items\n");
+	for (i = 11; i <= 100000; i++)
+		ac_htable_remove(htable, AC_LONG_TO_PTR(i));
+	printf("There are %lu item(s) in the hash table (size %u)\n",
+	       htable->count, htable->size);
+	printf("lookup: 10 -> %ld\n",
+	       AC_PTR_TO_LONG(ac_htable_lookup(htable, AC_LONG_TO_PTR(10))));
+	printf("lookup: 11 -> %p\n",
+	       ac_htable_lookup(htable, AC_LONG_TO_PTR(11)));
+	printf("Destoying hash table\n");
+	ac_htable_destroy(htable);
+
+	printf("New incrementally resized hash table with 100000 int keys\n");
+	htable = ac_htable_new(ac_hash_func_ptr, ac_cmp_ptr, NULL, NULL);
+	ac_htable_set_rehash_step(htable, 2);
+	visited = 0;
+	for (i = 1; i <= 100000; i++) {
+		ac_htable_insert(htable, AC_LONG_TO_PTR(i), AC_LONG_TO_PTR(i));
+		if (htable->old_entries)
+			visited++;
+		/* Look for an earlier entry that may still be in the old table */
+		if (ac_htable_lookup(htable, AC_LONG_TO_PTR((i / 2 + 1))) !=
+		    AC_LONG_TO_PTR((i / 2 + 1)))
+			break;
+	}
+	printf("There are %lu item(s) in the hash table (size %u), "
+	       "%ld inserts while resizing, lookup: %s\n", htable->count,
+	       htable->size, visited, i > 100000 ? "all found" :
+	       "missing entries");
+	for (i = 11; i <= 100000; i++)
+		ac_htable_remove(htable, AC_LONG_TO_PTR(i));
+	visited = 0;
+	ac_htable_foreach(htable, htable_count_entry, &visited);
+	printf("There are %lu item(s) in the hash table (size %u), "
+	       "%ld visited\n", htable->count, htable->size, visited);
+	ac_htable_destroy(htable);
+
+	printf("New pre-sized hash table for 100000 entries (max load 0.9)\n");
+	htable = ac_htable_new_sized(100000, 0.9f, ac_hash_func_ptr,
+				     ac_cmp_ptr, NULL, NULL);
+	size = htable->size;
+	for (i = 1; i <= 100000; i++)
+		ac_htable_insert(htable, AC_LONG_TO_PTR(i), AC_LONG_TO_PTR(i));
+	printf("There are %lu item(s) in the hash table (size %u -> %u)\n",
+	       htable->count, size, htable->size);
+	printf("Reserving room for 200000 entries\n");
+	ac_htable_reserve(htable, 200000);
+	size = htable->size;
+	for (i = 100001; i <= 200000; i++)
+		ac_htable_insert(htable, AC_LONG_TO_PTR(i), AC_LONG_TO_PTR(i));
+	printf("There are %lu item(s) in the hash table (size %u -> %u)\n",
+	       htable->count, size, htable->size);
+	printf("Destoying hash table\n");
+	ac_htable_destroy(htable);
+
+	printf("New 64-bit hash table with 10000 string keys\n");
+	htable = ac_htable_new64(ac_hash64_func_str, ac_cmp_str, free, NULL);
+	for (i = 0; i < 10000; i++) {
+		char key[32];
+
+		snprintf(key, sizeof(key), "key-%ld", i);
+		ac_htable_insert(htable, strdup(key), AC_LONG_TO_PTR(i));
+	}
+	for (i = 0; i < 10000; i++) {
+		char key[32];
+
+		snprintf(key, sizeof(key), "key-%ld", i);
+		if (ac_htable_lookup(htable, key) != AC_LONG_TO_PTR(i))
+			break;
+	}
+	printf("There are %lu item(s) in the hash table, lookup: %s\n",
+	       htable->count, i == 10000 ? "OK" : "FAIL");
+	printf("Destoying hash table\n");
+	ac_htable_destroy(htable);
+
+	printf("Bulk inserting/looking up 10000 entries\n");
+	htable = ac_htable_new(ac_hash_func_ptr, ac_cmp_ptr, NULL, NULL);
+	keys = malloc(10000 * sizeof(void *));
+	vals = malloc(10000 * sizeof(void *));
+	for (i = 0; i < 10000; i++) {
+		keys[i] = AC_LONG_TO_PTR(i + 1);
+		vals[i] = AC_LONG_TO_PTR(i + 1);
+	}
+	ac_htable_insert_many(htable, keys, vals, 10000);
+	printf("There are %lu item(s) in the hash table (size %u)\n",
+	       htable->count, htable->size);
+	memset(vals, 0, 10000 * sizeof(void *));
+	keys[9999] = AC_LONG_TO_PTR(20000);
+	ac_htable_lookup_many(htable, (const void * const *)keys, vals, 10000);
+	for (i = 0; i < 9999; i++) {
+		if (vals[i] != keys[i])
+			break;
+	}
+	printf("lookup: %s, 20000 -> %p\n", i == 9999 ? "OK" : "FAIL",
+	       vals[9999]);
+	free(keys);
+	free(vals);
+	printf("Destoying hash table\n");
+	ac_htable_destroy(htable);
+
+	printf("Removing even keys with an iterator, 1000 entries at a time\n");
+	htable = ac_htable_new(ac_hash_func_ptr, ac_cmp_ptr, NULL, NULL);
+	for (i = 1; i <= 100000; i++)
+		ac_htable_insert(htable, AC_LONG_TO_PTR(i), AC_LONG_TO_PTR(i));
+	ac_htable_iter_init(&iter, htable);
+	for (visited = 0;; ) {
+		void *key;
+		int n;
+
+		for (n = 0; n < 1000; n++) {
+			if (!ac_htable_iter_next(&iter, &key, NULL))
+				break;
+			visited++;
+			if (AC_PTR_TO_LONG(key) % 2 == 0)
+				ac_htable_iter_remove(&iter);
+		}
+		if (n < 1000)
+			break;
+	}
+	for (i = 1; i <= 100000; i++) {
+		bool found = ac_htable_lookup(htable, AC_LONG_TO_PTR(i));
+
+		if (found != (i % 2))
+			break;
+	}
+	printf("Visited %ld entries, %lu item(s) left, lookup: %s\n",
+	       visited, htable->count, i > 100000 ? "OK" : "FAIL");
+	printf("Destoying hash table\n");
+	ac_htable_destroy(htable);
+
+	printf("New hash table with 10000 dynamically allocated string keys\n");
+	htable = ac_htable_new(ac_hash_func_str, htable_cmp_str, free, NULL);
+	for (i = 0; i < 10000; i++) {
+		char key[32];
+
+		snprintf(key, sizeof(key), "key-%ld", i);
+		ac_htable_insert(htable, strdup(key), AC_LONG_TO_PTR(i));
+	}
+	htable_nr_cmps = 0;
+	for (i = 0; i < 10000; i++) {
+		char key[32];
+
+		snprintf(key, sizeof(key), "key-%ld", i);
+		ac_htable_lookup(htable, key);
+	}
+	printf("10000 lookups made %lu key comparison(s)\n", htable_nr_cmps);
+	printf("Destoying hash table\n");
+	ac_htable_destroy(htable);
+
+	htable = ac_htable_new_sized(16, 1.0f, ac_hash_func_ptr, ac_cmp_ptr,
+				     NULL, NULL);
+	printf("ac_htable_new_sized() with a max load of 1.0 -> %s\n",
+	       htable ? "OK" : "EINVAL");
+	if (htable)
+		ac_htable_destroy(htable);
+
+	htable_concurrent_test();
+	htable_rcu_test();
+	htable_img_test();
+
 	printf("*** %s\n\n", __func__);
 }
 
@@ -587,6 +1463,19 @@ static void misc_test(void)
 		printf("%d ", shuff_list[i]);
 	printf("\b\n");
 
+	printf("ac_hash_func_str(\"hello\")   : 0x%08x\n",
+	       ac_hash_func_str("hello"));
+	printf("ac_hash_buf(\"hello\", 5)    : 0x%016" PRIx64 "\n",
+	       ac_hash_buf("hello", 5));
+	printf("ac_hash_func_u64(%" PRIu64 ") : 0x%08x\n", luhn_ok,
+	       ac_hash_func_u64(&luhn_ok));
+	printf("ac_hash64_func_str(\"hello\") : 0x%016" PRIx64 "\n",
+	       ac_hash64_func_str("hello"));
+	ac_hash_set_seed(42);
+	printf("ac_hash_func_str(\"hello\")   : 0x%08x (seed 42)\n",
+	       ac_hash_func_str("hello"));
+	ac_hash_set_seed(0);
+
 	printf("AC_MIN(30, 10)            : %d\n", AC_MIN(30, 10));
 	printf("AC_MAX(0, -1)             : %d\n", AC_MAX(0, -1));
 	printf("AC_ARRAY_SIZE(shuff_list) : %ld\n", AC_ARRAY_SIZE(shuff_list));
@@ -1046,6 +1935,7 @@ int main(int argc, char *argv[])
 			name##_test(); \
 	} while (0)
 
+	gate(arena);
 	gate(btree);
 	gate(byte);
 	gate(circ_buf);